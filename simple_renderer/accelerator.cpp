@@ -0,0 +1,673 @@
+#include "accelerator.h"
+#include "render.h"
+
+// Run a query on a surface, or for an instance on its mesh in object space. The
+// object ray has the same t, so hits compare and clip against the world ray.
+template <typename Query>
+static Interaction intersectInstance(Surface *surface, Ray &ray, Query query)
+{
+    if (surface->mesh == NULL)
+    {
+        return query(surface, ray);
+    }
+    Ray objectRay(surface->toObject.point(ray.o), surface->toObject.vector(ray.d), ray.t, ray.tmax);
+    Interaction si = query(surface->mesh, objectRay);
+    if (si.didIntersect)
+    {
+        ray.t = objectRay.t;
+        si.p = ray.o + ray.d * si.t;
+        si.n = surface->toObject.normalFromInverse(si.n);
+    }
+    return si;
+}
+
+template <typename Query>
+static bool occludesInstance(Surface *surface, const Ray &ray, Query query)
+{
+    if (surface->mesh == NULL)
+    {
+        return query(surface, ray);
+    }
+    return query(surface->mesh, Ray(surface->toObject.point(ray.o), surface->toObject.vector(ray.d), ray.t, ray.tmax));
+}
+
+void NaiveAccelerator::build(Scene &scene)
+{
+    this->surfaces.clear();
+    for (auto &surface : scene.surfaces)
+    {
+        this->surfaces.push_back(&surface);
+    }
+}
+
+Interaction NaiveAccelerator::rayIntersect(Ray &ray)
+{
+    Interaction siFinal;
+
+    for (Surface *surface : this->surfaces)
+    {
+        Interaction si = intersectInstance(surface, ray, [](Surface *s, Ray &r)
+                                           { return s->rayIntersectFaces(r, 0, s->indices.size()); });
+        if (si.didIntersect)
+        {
+            siFinal = si;
+        }
+    }
+
+    return siFinal;
+}
+
+bool NaiveAccelerator::occluded(const Ray &ray)
+{
+    for (Surface *surface : this->surfaces)
+    {
+        if (occludesInstance(surface, ray, [](Surface *s, const Ray &r)
+                             { return s->occludedFaces(r); }))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AABBAccelerator::build(Scene &scene)
+{
+    this->surfaces.clear();
+    for (auto &surface : scene.surfaces)
+    {
+        this->surfaces.push_back(&surface);
+    }
+    this->stats.nodes = this->surfaces.size();
+}
+
+Interaction AABBAccelerator::rayIntersect(Ray &ray)
+{
+    Interaction siFinal;
+
+    for (Surface *surface : this->surfaces)
+    {
+        float tEntry;
+        ray_stats.nodeTests++;
+        if (surface->slab_test(ray, tEntry))
+        {
+            Interaction si = intersectInstance(surface, ray, [](Surface *s, Ray &r)
+                                               { return s->rayIntersectLeaf(r, 0, s->indices.size()); });
+            if (si.didIntersect)
+            {
+                siFinal = si;
+            }
+        }
+    }
+
+    return siFinal;
+}
+
+bool AABBAccelerator::occluded(const Ray &ray)
+{
+    for (Surface *surface : this->surfaces)
+    {
+        float tEntry;
+        ray_stats.nodeTests++;
+        if (surface->slab_test(ray, tEntry) && occludesInstance(surface, ray, [](Surface *s, const Ray &r)
+                                                                { return s->occludedLeaf(r, 0, s->indices.size()); }))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// closest hit with a surface in a leaf of the BVH over the surfaces
+template <bool TwoLevel>
+static Interaction intersectSurface(Surface *surface, Ray &ray)
+{
+    return intersectInstance(surface, ray, [](Surface *s, Ray &r)
+                             { return TwoLevel ? s->Traverse_BVH(r) : s->rayIntersectLeaf(r, 0, s->indices.size()); });
+}
+
+template <bool TwoLevel>
+static bool occludesSurface(Surface *surface, const Ray &ray)
+{
+    return occludesInstance(surface, ray, [](Surface *s, const Ray &r)
+                            { return TwoLevel ? s->occluded(r) : s->occludedLeaf(r, 0, s->indices.size()); });
+}
+
+static void deleteBVH(BVH_object *node)
+{
+    if (node->left != NULL)
+    {
+        deleteBVH(node->left);
+        deleteBVH(node->right);
+        delete node->left;
+        delete node->right;
+    }
+    delete[] node->surfaces;
+}
+
+static void countBVH(BVH_object *node, AcceleratorStats &stats)
+{
+    stats.nodes++;
+    stats.bytes += sizeof(BVH_object) + node->Num_Of_Surfaces * sizeof(Surface *);
+    if (node->left != NULL)
+    {
+        countBVH(node->left, stats);
+        countBVH(node->right, stats);
+    }
+}
+
+// bottom-up refit of the boxes to the current surface boxes, keeping the tree
+static void refitBVH(BVH_object *node)
+{
+    Vector3f min = Vector3f(1e30, 1e30, 1e30);
+    Vector3f max = Vector3f(-1e30, -1e30, -1e30);
+    if (node->left != NULL)
+    {
+        refitBVH(node->left);
+        refitBVH(node->right);
+        for (BVH_object *child : {node->left, node->right})
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                min[j] = std::min(min[j], child->aabb[0][j]);
+                max[j] = std::max(max[j], child->aabb[1][j]);
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < node->Num_Of_Surfaces; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                min[j] = std::min(min[j], node->surfaces[i]->aabb[0][j]);
+                max[j] = std::max(max[j], node->surfaces[i]->aabb[1][j]);
+            }
+        }
+    }
+    node->aabb[0] = min;
+    node->aabb[1] = max;
+}
+
+template <bool TwoLevel>
+BVHAccelerator<TwoLevel>::BVHAccelerator()
+{
+    this->bvh.left = NULL;
+    this->bvh.right = NULL;
+    this->bvh.surfaces = NULL;
+    this->bvh.Num_Of_Surfaces = 0;
+}
+
+template <bool TwoLevel>
+BVHAccelerator<TwoLevel>::~BVHAccelerator()
+{
+    deleteBVH(&this->bvh);
+}
+
+template <bool TwoLevel>
+void BVHAccelerator<TwoLevel>::build(Scene &scene)
+{
+    deleteBVH(&this->bvh);
+
+    // initialize the BVH
+    this->bvh.Num_Of_Surfaces = scene.surfaces.size();
+    this->bvh.surfaces = new Surface *[this->bvh.Num_Of_Surfaces];
+    Vector3f min = Vector3f(1e30, 1e30, 1e30);
+    Vector3f max = Vector3f(-1e30, -1e30, -1e30);
+    for (int i = 0; i < this->bvh.Num_Of_Surfaces; ++i)
+    {
+        this->bvh.surfaces[i] = &scene.surfaces[i];
+        for (int j = 0; j < 3; ++j)
+        {
+            if (scene.surfaces[i].aabb[0][j] < min[j])
+            {
+                min[j] = scene.surfaces[i].aabb[0][j];
+            }
+            if (scene.surfaces[i].aabb[1][j] > max[j])
+            {
+                max[j] = scene.surfaces[i].aabb[1][j];
+            }
+        }
+    }
+    this->bvh.aabb[0] = min;
+    this->bvh.aabb[1] = max;
+    this->bvh.left = NULL;
+    this->bvh.right = NULL;
+    this->PopulateBVH(&this->bvh);
+    // this->PrintBVH(&this->bvh, 0);
+
+    // a rebuild replaces the counts of the previous tree
+    this->stats.nodes = 0;
+    this->stats.bytes = 0;
+    countBVH(&this->bvh, this->stats);
+}
+
+template <bool TwoLevel>
+void BVHAccelerator<TwoLevel>::refit(Scene &)
+{
+    refitBVH(&this->bvh);
+}
+
+template <bool TwoLevel>
+Interaction BVHAccelerator<TwoLevel>::rayIntersect(Ray &ray)
+{
+    return this->Traverse_BVH(ray, &this->bvh);
+}
+
+template <bool TwoLevel>
+bool BVHAccelerator<TwoLevel>::occluded(const Ray &ray)
+{
+    float tEntry;
+
+    ray_stats.nodeTests++;
+    if (this->bvh.Num_Of_Surfaces == 0 || !this->bvh.slab_test(ray, tEntry))
+    {
+        return false;
+    }
+
+    // any hit will do, so the nodes are visited in no particular order
+    BVH_object *stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    BVH_object *current_node = &this->bvh;
+
+    while (true)
+    {
+        if (current_node->left == NULL)
+        {
+            for (int i = 0; i < current_node->Num_Of_Surfaces; ++i)
+            {
+                if (occludesSurface<TwoLevel>(current_node->surfaces[i], ray))
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            BVH_object *left = current_node->left;
+            BVH_object *right = current_node->right;
+            float tLeft, tRight;
+            bool hitLeft = left->slab_test(ray, tLeft);
+            bool hitRight = right->slab_test(ray, tRight);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft && hitRight)
+            {
+                stack[stackSize++] = right;
+                current_node = left;
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current_node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+        {
+            return false;
+        }
+        current_node = stack[--stackSize];
+    }
+}
+
+template <bool TwoLevel>
+void BVHAccelerator<TwoLevel>::PrintBVH(BVH_object *curNode, int lvl)
+{
+    for (int i = 0; i < lvl; ++i)
+    {
+        printf("  ");
+    }
+    for (int i = 0; i < curNode->Num_Of_Surfaces; ++i)
+    {
+        printf("%d ", curNode->surfaces[i]->shapeIdx);
+    }
+    printf("\n");
+    if (curNode->left != NULL)
+    {
+        this->PrintBVH(curNode->left, lvl + 1);
+    }
+    if (curNode->right != NULL)
+    {
+        this->PrintBVH(curNode->right, lvl + 1);
+    }
+}
+
+template <bool TwoLevel>
+void BVHAccelerator<TwoLevel>::PopulateBVH(BVH_object *curNode)
+{
+    // use Median Split to build the BVH
+    // 1. find the longest axis of the bounding box
+    // 2. partition the surfaces at the median along the longest axis
+    // 3. split the surfaces into two groups
+    // 4. repeat the process for each group until all surface reside in a leaf node
+
+    // check if the current node is a leaf node
+    // printf("%ld ", curNode->Num_Of_Surfaces);
+    // printf("AABB: ");
+    // printf("min: ");
+    // for(int i = 0; i < 3; ++i)
+    // {
+    //     printf("%f ", curNode->aabb[0][i]);
+    // }
+    // printf("max: ");
+    // for(int i = 0; i < 3; ++i)
+    // {
+    //     printf("%f ", curNode->aabb[1][i]);
+    // }
+    // printf("\n");
+    if (curNode->Num_Of_Surfaces <= 1)
+    {
+        // printf("Leaf Node %d\n", curNode->surfaces[0]->shapeIdx);
+        return;
+    }
+
+    // find the longest axis of the bounding box
+    Vector3f box_size = curNode->aabb[1] - curNode->aabb[0];
+    int longest_axis = 0;
+    if (box_size[1] > box_size[0])
+    {
+        longest_axis = 1;
+    }
+    if (box_size[2] > box_size[longest_axis])
+    {
+        longest_axis = 2;
+    }
+
+    // move the median surface along the longest axis into place, the halves need not be sorted
+    std::nth_element(curNode->surfaces, curNode->surfaces + curNode->Num_Of_Surfaces / 2, curNode->surfaces + curNode->Num_Of_Surfaces,
+                     [longest_axis](Surface *a, Surface *b) -> bool
+                     { return a->aabb[0][longest_axis] < b->aabb[0][longest_axis]; });
+
+    // split the surfaces into two groups
+    BVH_object *left_node = new BVH_object();
+    BVH_object *right_node = new BVH_object();
+    left_node->Num_Of_Surfaces = curNode->Num_Of_Surfaces / 2;
+    right_node->Num_Of_Surfaces = curNode->Num_Of_Surfaces - left_node->Num_Of_Surfaces;
+    left_node->surfaces = new Surface *[left_node->Num_Of_Surfaces];
+    right_node->surfaces = new Surface *[right_node->Num_Of_Surfaces];
+
+    // update the bounding box of the left and right node
+    left_node->aabb[0] = Vector3f(1e30, 1e30, 1e30);
+    left_node->aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+
+    right_node->aabb[0] = Vector3f(1e30, 1e30, 1e30);
+    right_node->aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+
+    // update the surfaces and bounding boxes of the left and right node
+    for (int i = 0; i < left_node->Num_Of_Surfaces; ++i)
+    {
+        left_node->surfaces[i] = curNode->surfaces[i];
+        for (int j = 0; j < 3; ++j)
+        {
+            left_node->aabb[0][j] = std::min(left_node->surfaces[i]->aabb[0][j], left_node->aabb[0][j]);
+            left_node->aabb[1][j] = std::max(left_node->surfaces[i]->aabb[1][j], left_node->aabb[1][j]);
+        }
+    }
+    for (int i = 0; i < right_node->Num_Of_Surfaces; ++i)
+    {
+        right_node->surfaces[i] = curNode->surfaces[i + left_node->Num_Of_Surfaces];
+        for (int j = 0; j < 3; ++j)
+        {
+            right_node->aabb[0][j] = std::min(right_node->surfaces[i]->aabb[0][j], right_node->aabb[0][j]);
+            right_node->aabb[1][j] = std::max(right_node->surfaces[i]->aabb[1][j], right_node->aabb[1][j]);
+        }
+    }
+
+    // left_node->aabb[1][longest_axis] = (curNode->surfaces[left_node->Num_Of_Surfaces - 1])->aabb[0][longest_axis];
+    // right_node->aabb[0][longest_axis] = (curNode->surfaces[left_node->Num_Of_Surfaces])->aabb[0][longest_axis];
+
+    // update the current node
+    curNode->left = left_node;
+    curNode->right = right_node;
+
+    // recursively build the BVH
+    this->PopulateBVH(left_node);
+    this->PopulateBVH(right_node);
+
+    return;
+}
+
+template <bool TwoLevel>
+Interaction BVHAccelerator<TwoLevel>::Traverse_BVH(Ray &ray, BVH_object *root)
+{
+    Interaction siFinal;
+    float tEntry;
+
+    ray_stats.nodeTests++;
+    if (this->bvh.Num_Of_Surfaces == 0 || !root->slab_test(ray, tEntry))
+    {
+        return siFinal;
+    }
+
+    // nodes still to visit, with the distance at which the ray enters them
+    BVH_object *stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int stackSize = 0;
+    BVH_object *current_node = root;
+
+    while (true)
+    {
+        if (current_node->left == NULL)
+        {
+            // leaf: its box is the box of the surface, so intersect directly
+            for (int i = 0; i < current_node->Num_Of_Surfaces; ++i)
+            {
+                Interaction si = intersectSurface<TwoLevel>(current_node->surfaces[i], ray);
+                if (si.didIntersect)
+                {
+                    siFinal = si;
+                }
+            }
+        }
+        else
+        {
+            BVH_object *left = current_node->left;
+            BVH_object *right = current_node->right;
+            float tLeft, tRight;
+            bool hitLeft = left->slab_test(ray, tLeft);
+            bool hitRight = right->slab_test(ray, tRight);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft && hitRight)
+            {
+                // visit the nearer child first and come back for the other one
+                if (tRight < tLeft)
+                {
+                    std::swap(left, right);
+                    std::swap(tLeft, tRight);
+                }
+                stack[stackSize] = right;
+                stackEntry[stackSize] = tRight;
+                stackSize++;
+                current_node = left;
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current_node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        // next node on the stack that the ray enters before the closest hit
+        do
+        {
+            if (stackSize == 0)
+            {
+                return siFinal;
+            }
+            stackSize--;
+        } while (stackEntry[stackSize] > ray.t);
+        current_node = stack[stackSize];
+    }
+}
+
+template <bool TwoLevel>
+template <int N>
+void BVHAccelerator<TwoLevel>::Traverse_BVHPacket(Ray rays[], RayPacket<N> &packet, int active, Interaction si[])
+{
+    float tEntry[N];
+    ray_stats.nodeTests++;
+    if (this->bvh.Num_Of_Surfaces == 0 || !(active = slabTestPacket<N>(this->bvh.aabb, packet, active, tEntry)))
+    {
+        return;
+    }
+
+    // nodes still to visit, with the rays that enter them and where
+    struct StackEntry {
+        BVH_object *node;
+        int active;
+        float tEntry[N];
+    } stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    BVH_object *current_node = &this->bvh;
+
+    while (true)
+    {
+        if (packetDiverged<N>(active))
+        {
+            // too few rays left to fill the SIMD lanes: finish this subtree one ray at a time
+            for (int k = 0; k < N; ++k)
+            {
+                if (active & (1 << k))
+                {
+                    Interaction s = this->Traverse_BVH(rays[k], current_node);
+                    if (s.didIntersect)
+                    {
+                        si[k] = s;
+                        packet.t[k] = rays[k].t;
+                    }
+                }
+            }
+        }
+        else if (current_node->left == NULL)
+        {
+            // leaf: its box is the box of the surface, so intersect directly
+            for (int i = 0; i < current_node->Num_Of_Surfaces; ++i)
+            {
+                Surface *surface = current_node->surfaces[i];
+                // instances move every ray into their own object space, so they take the rays one by one
+                if (TwoLevel && surface->mesh == NULL)
+                {
+                    surface->Traverse_BVHPacket<N>(rays, packet, active, si);
+                    continue;
+                }
+                for (int k = 0; k < N; ++k)
+                {
+                    if (active & (1 << k))
+                    {
+                        Interaction s = intersectSurface<TwoLevel>(surface, rays[k]);
+                        if (s.didIntersect)
+                        {
+                            si[k] = s;
+                            packet.t[k] = rays[k].t;
+                        }
+                    }
+                }
+            }
+        }
+        else
+        {
+            StackEntry hitLeft, hitRight;
+            hitLeft.node = current_node->left;
+            hitLeft.active = slabTestPacket<N>(hitLeft.node->aabb, packet, active, hitLeft.tEntry);
+            hitRight.node = current_node->right;
+            hitRight.active = slabTestPacket<N>(hitRight.node->aabb, packet, active, hitRight.tEntry);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft.active && hitRight.active)
+            {
+                // visit the child that the first ray entering both enters first
+                int both = hitLeft.active & hitRight.active;
+                if (both && hitRight.tEntry[firstRay(both)] < hitLeft.tEntry[firstRay(both)])
+                {
+                    std::swap(hitLeft, hitRight);
+                }
+                stack[stackSize++] = hitRight;
+                current_node = hitLeft.node;
+                active = hitLeft.active;
+                continue;
+            }
+            if (hitLeft.active || hitRight.active)
+            {
+                current_node = hitLeft.active ? hitLeft.node : hitRight.node;
+                active = hitLeft.active | hitRight.active;
+                continue;
+            }
+        }
+
+        // next node on the stack that a ray enters before its closest hit
+        do
+        {
+            if (stackSize == 0)
+            {
+                return;
+            }
+            const StackEntry &entry = stack[--stackSize];
+            active = 0;
+            for (int k = 0; k < N; ++k)
+            {
+                active |= ((entry.active >> k) & 1 && entry.tEntry[k] <= packet.t[k]) << k;
+            }
+            current_node = entry.node;
+        } while (!active);
+    }
+}
+
+template <bool TwoLevel>
+template <int N>
+void BVHAccelerator<TwoLevel>::rayIntersectPacket(Ray rays[N], Interaction si[N], int active)
+{
+    for (int k = 0; k < N; ++k)
+    {
+        si[k] = Interaction();
+    }
+
+    RayPacket<N> packet(rays);
+    this->Traverse_BVHPacket<N>(rays, packet, active, si);
+}
+
+template struct BVHAccelerator<false>;
+template struct BVHAccelerator<true>;
+
+template <typename T>
+static std::shared_ptr<Accelerator> makeAccelerator()
+{
+    return std::make_shared<T>();
+}
+
+std::map<std::string, AcceleratorFactory> &acceleratorRegistry()
+{
+    static std::map<std::string, AcceleratorFactory> registry = {
+        {"naive", makeAccelerator<NaiveAccelerator>},
+        {"aabb", makeAccelerator<AABBAccelerator>},
+        {"bvh", makeAccelerator<BVHAccelerator<false>>},
+        {"two_level_bvh", makeAccelerator<BVHAccelerator<true>>},
+    };
+    return registry;
+}
+
+bool registerAccelerator(const std::string &name, AcceleratorFactory factory)
+{
+    return acceleratorRegistry().insert({name, factory}).second;
+}
+
+std::shared_ptr<Accelerator> createAccelerator(const std::string &name)
+{
+    auto entry = acceleratorRegistry().find(name);
+    if (entry == acceleratorRegistry().end())
+    {
+        std::cerr << "Unknown accelerator \"" << name << "\", expected one of:";
+        for (auto &registered : acceleratorRegistry())
+        {
+            std::cerr << " " << registered.first;
+        }
+        std::cerr << std::endl;
+        exit(1);
+    }
+
+    std::shared_ptr<Accelerator> accelerator = entry->second();
+    accelerator->name = name;
+    return accelerator;
+}
@@ -29,20 +29,52 @@ Camera::Camera(Vector3f from, Vector3f to, Vector3f up, float fieldOfView, Vecto
 
     // Upper left
     this->upperLeft = from - this->w * this->focusDistance - viewportU / 2.f - viewportV / 2.f;
+    this->toUpperLeft = (((this->upperLeft)/PRECISION) - ((this->from)/PRECISION)) * PRECISION;
 }
 
-Ray Camera::generateRay(int x, int y)
+Ray Camera::generateRay(int x, int y) const
 {
-    // Vector3f pixelCenter = this->upperLeft + 0.5f * (this->pixelDeltaU + this->pixelDeltaV);
-    
     Vector3f pixelCenter = (x + 0.5f) * this->pixelDeltaU + (y + 0.5f) * this->pixelDeltaV;
-    Vector3f standard = (((this->upperLeft)/PRECISION) - ((this->from)/PRECISION)) * PRECISION;
-    // std:: cout << "standard: " << standard.x << " " << standard.y << " " << standard.z << std::endl;
-    
-    Vector3f direction = Normalize(pixelCenter + standard);
-
-    // std::cout << "direction: " << direction.x << " " << direction.y << " " << direction.z << std::endl;
-
+    Vector3f direction = Normalize(pixelCenter + this->toUpperLeft);
 
     return Ray(this->from, direction);
-}
\ No newline at end of file
+}
+
+void Camera::generateRays(int x, int y, int count, CameraRays &rays, size_t first) const
+{
+    // the terms are added in the order of generateRay, and the length is rounded to
+    // float as Vector3f::Length does, so both give the same directions
+    double rowV[3] = {(y + 0.5f) * this->pixelDeltaV.x, (y + 0.5f) * this->pixelDeltaV.y, (y + 0.5f) * this->pixelDeltaV.z};
+    int k = 0;
+#ifdef VEC_SSE
+    for (; k + 2 <= count; k += 2)
+    {
+        __m128d px = _mm_set_pd(x + k + 1 + 0.5f, x + k + 0.5f);
+        __m128d d[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128d center = _mm_add_pd(_mm_mul_pd(px, _mm_set1_pd(this->pixelDeltaU[a])), _mm_set1_pd(rowV[a]));
+            d[a] = _mm_add_pd(center, _mm_set1_pd(this->toUpperLeft[a]));
+        }
+        __m128d lengthSquared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(d[0], d[0]), _mm_mul_pd(d[1], d[1])), _mm_mul_pd(d[2], d[2]));
+        __m128 length = _mm_sqrt_ps(_mm_cvtpd_ps(lengthSquared));
+        __m128d inv = _mm_cvtps_pd(_mm_div_ps(_mm_set1_ps(1.f), length));
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128d dir = _mm_mul_pd(d[a], inv);
+            _mm_storeu_pd(&rays.dir[a][first + k], dir);
+            _mm_storeu_pd(&rays.invDir[a][first + k], _mm_div_pd(_mm_set1_pd(1.0), dir));
+        }
+    }
+#endif
+    for (; k < count; ++k)
+    {
+        Vector3f center = (x + k + 0.5f) * this->pixelDeltaU + Vector3f(rowV[0], rowV[1], rowV[2]);
+        Vector3f direction = Normalize(center + this->toUpperLeft);
+        for (int a = 0; a < 3; ++a)
+        {
+            rays.dir[a][first + k] = direction[a];
+            rays.invDir[a][first + k] = 1.0 / direction[a];
+        }
+    }
+}
@@ -0,0 +1,250 @@
+#include "dedup.h"
+#include "mesh_cache.h"
+
+#include <tuple>
+#include <unordered_map>
+
+// Copies may differ by the rounding of the exported numbers: a vertex matches if it is within this
+// fraction of the diagonal of the mesh box from the moved mesh vertex, a normal within this distance
+#define DEDUP_POSITION_TOLERANCE 1e-4
+#define DEDUP_NORMAL_TOLERANCE 1e-3
+
+// A mesh that later surfaces are compared against, and the copies found so far
+struct MeshCandidate {
+    size_t surface; // index in surfaces
+    std::vector<Vector3i> faces; // sorted, see sortedFaces
+    Vector3f centroid;
+    size_t first, second; // vertices that fix the frame of the mesh
+    Vector3f axes[3]; // orthonormal frame through the centroid, first and second vertex
+    double tolerance;
+    std::vector<std::pair<size_t, Transform>> copies; // surface index and mesh to copy transform, the mesh itself included
+};
+
+static bool isBuilt(const Surface &surf)
+{
+    return !surf.bvh.nodes.empty();
+}
+
+// Faces without the references that spatial splits added, in a fixed order, so that copies
+// compare equal whatever order their BVHs put the faces in
+static std::vector<Vector3i> sortedFaces(const Surface &surf)
+{
+    std::vector<Vector3i> faces = surf.indices;
+    std::sort(faces.begin(), faces.end(), [](const Vector3i &a, const Vector3i &b)
+              { return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z); });
+    faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+    return faces;
+}
+
+// Hash of what copies have in common exactly: faces, uvs, material and BVH settings
+static uint64_t copyKey(const Surface &surf, const std::vector<Vector3i> &faces)
+{
+    uint64_t counts[2] = {surf.vertices.size(), faces.size()};
+    double material[5] = {double(surf.isLight), surf.diffuse.x, surf.diffuse.y, surf.diffuse.z, surf.alpha};
+    uint64_t settings = hashBVHSettings(surf.bvh.settings);
+
+    uint64_t hash = hashBytes(reinterpret_cast<const char *>(counts), sizeof(counts));
+    hash = hashBytes(reinterpret_cast<const char *>(faces.data()), faces.size() * sizeof(Vector3i), hash);
+    hash = hashBytes(reinterpret_cast<const char *>(surf.uvs.data()), surf.uvs.size() * sizeof(Vector2f), hash);
+    hash = hashBytes(reinterpret_cast<const char *>(material), sizeof(material), hash);
+    hash = hashBytes(surf.diffuseTextureName.data(), surf.diffuseTextureName.size(), hash);
+    hash = hashBytes(surf.alphaTextureName.data(), surf.alphaTextureName.size(), hash);
+    return hashBytes(reinterpret_cast<const char *>(&settings), sizeof(settings), hash);
+}
+
+static bool sameCopyData(const Surface &mesh, const std::vector<Vector3i> &meshFaces, const Surface &copy,
+                         const std::vector<Vector3i> &copyFaces)
+{
+    return mesh.vertices.size() == copy.vertices.size() && mesh.normals.size() == copy.normals.size() &&
+           meshFaces == copyFaces && mesh.uvs == copy.uvs && mesh.isLight == copy.isLight &&
+           mesh.diffuse == copy.diffuse && mesh.alpha == copy.alpha &&
+           mesh.diffuseTextureName == copy.diffuseTextureName && mesh.alphaTextureName == copy.alphaTextureName &&
+           hashBVHSettings(mesh.bvh.settings) == hashBVHSettings(copy.bvh.settings);
+}
+
+static Vector3f vertexCentroid(const Surface &surf)
+{
+    Vector3f sum(0, 0, 0);
+    for (const Vector3f &v : surf.vertices)
+        sum += v;
+    return sum / double(surf.vertices.size());
+}
+
+// Orthonormal frame with the first axis towards vertex first and the second vertex in the plane
+// of the first two axes. Copies have their vertices in the same order, so the same two vertices
+// give the frame of a copy, rotated like the copy.
+static void rigidFrame(const Surface &surf, const Vector3f &centroid, size_t first, size_t second, Vector3f axes[3])
+{
+    axes[0] = Normalize(surf.vertices[first] - centroid);
+    axes[2] = Normalize(Cross(axes[0], surf.vertices[second] - centroid));
+    axes[1] = Cross(axes[2], axes[0]);
+}
+
+// Pick the frame vertices of a new mesh: the vertex farthest from the centroid, then the one
+// farthest from that axis. Meshes on a line or at a point have no unique frame and are not shared.
+static bool makeCandidate(const Surface &surf, size_t surfaceIdx, const Vector3f &centroid, MeshCandidate &candidate)
+{
+    candidate.surface = surfaceIdx;
+    candidate.centroid = centroid;
+    candidate.tolerance = DEDUP_POSITION_TOLERANCE * (surf.aabb[1] - surf.aabb[0]).Length();
+
+    candidate.first = 0;
+    for (size_t v = 1; v < surf.vertices.size(); ++v)
+    {
+        if ((surf.vertices[v] - centroid).LengthSquared() > (surf.vertices[candidate.first] - centroid).LengthSquared())
+            candidate.first = v;
+    }
+    Vector3f axis = surf.vertices[candidate.first] - centroid;
+    if (axis.Length() <= 100 * candidate.tolerance)
+        return false;
+    axis = Normalize(axis);
+
+    candidate.second = 0;
+    double farthest = 0;
+    for (size_t v = 0; v < surf.vertices.size(); ++v)
+    {
+        double distance = Cross(axis, surf.vertices[v] - centroid).Length();
+        if (distance > farthest)
+        {
+            candidate.second = v;
+            farthest = distance;
+        }
+    }
+    if (farthest <= 100 * candidate.tolerance)
+        return false;
+
+    rigidFrame(surf, centroid, candidate.first, candidate.second, candidate.axes);
+    candidate.copies.push_back(std::make_pair(surfaceIdx, Transform()));
+    return true;
+}
+
+// Transform that moves the mesh onto copy, if it does so for every vertex and normal
+static bool matchCopy(const Surface &mesh, const MeshCandidate &candidate, const Surface &copy, const Vector3f &copyCentroid,
+                      Transform &toCopy)
+{
+    Vector3f axes[3];
+    rigidFrame(copy, copyCentroid, candidate.first, candidate.second, axes);
+
+    // the rotation takes the frame of the mesh to the frame of the copy
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            toCopy.m[r][c] = axes[0][r] * candidate.axes[0][c] + axes[1][r] * candidate.axes[1][c] + axes[2][r] * candidate.axes[2][c];
+        }
+    }
+    Vector3f translation = copyCentroid - toCopy.vector(candidate.centroid);
+    for (int r = 0; r < 3; ++r)
+    {
+        toCopy.m[r][3] = translation[r];
+    }
+
+    // written so that a degenerate frame (NaN) never matches
+    for (size_t v = 0; v < mesh.vertices.size(); ++v)
+    {
+        if (!((toCopy.point(mesh.vertices[v]) - copy.vertices[v]).Length() <= candidate.tolerance))
+            return false;
+    }
+    for (size_t v = 0; v < mesh.normals.size(); ++v)
+    {
+        if (!((toCopy.vector(mesh.normals[v]) - copy.normals[v]).Length() <= DEDUP_NORMAL_TOLERANCE))
+            return false;
+    }
+    return true;
+}
+
+DedupStats deduplicateSurfaces(std::vector<Surface> &surfaces, std::vector<Surface> &meshes)
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    DedupStats stats;
+
+    // every surface is compared with the meshes found so far that share its hash
+    std::vector<MeshCandidate> candidates;
+    std::unordered_map<uint64_t, std::vector<size_t>> buckets;
+    for (size_t s = 0; s < surfaces.size(); ++s)
+    {
+        const Surface &surf = surfaces[s];
+        if (surf.mesh != NULL || surf.vertices.empty())
+            continue;
+
+        std::vector<Vector3i> faces = sortedFaces(surf);
+        std::vector<size_t> &bucket = buckets[copyKey(surf, faces)];
+        Vector3f centroid = vertexCentroid(surf);
+
+        bool isCopy = false;
+        for (size_t c : bucket)
+        {
+            MeshCandidate &candidate = candidates[c];
+            Transform toCopy;
+            if (sameCopyData(surfaces[candidate.surface], candidate.faces, surf, faces) &&
+                matchCopy(surfaces[candidate.surface], candidate, surf, centroid, toCopy))
+            {
+                candidate.copies.push_back(std::make_pair(s, toCopy));
+                isCopy = true;
+                break;
+            }
+        }
+
+        MeshCandidate candidate;
+        if (!isCopy && makeCandidate(surf, s, centroid, candidate))
+        {
+            candidate.faces = std::move(faces);
+            bucket.push_back(candidates.size());
+            candidates.push_back(std::move(candidate));
+        }
+    }
+
+    // meshes with copies move to meshes, which must not reallocate once instances point into it
+    std::vector<const MeshCandidate *> shared;
+    for (const MeshCandidate &candidate : candidates)
+    {
+        if (candidate.copies.size() > 1)
+            shared.push_back(&candidate);
+    }
+    size_t firstMesh = meshes.size();
+    meshes.reserve(firstMesh + shared.size());
+    for (const MeshCandidate *candidate : shared)
+    {
+        Surface &surf = surfaces[candidate->surface];
+        if (!isBuilt(surf))
+            surf.PopulateBVH(surf.bvh.settings);
+        meshes.push_back(std::move(surf));
+    }
+
+    for (size_t m = 0; m < shared.size(); ++m)
+    {
+        Surface *mesh = &meshes[firstMesh + m];
+        size_t meshBytes = mesh->memoryUsage().bytes;
+        for (auto &copy : shared[m]->copies)
+        {
+            Surface &surf = surfaces[copy.first];
+            if (copy.first != shared[m]->surface)
+            {
+                // copies loaded with a BVH free it here, the others are never built
+                if (isBuilt(surf))
+                {
+                    stats.bytesSaved += surf.memoryUsage().bytes;
+                }
+                else
+                {
+                    stats.bytesSaved += meshBytes;
+                    stats.buildMsSaved += mesh->bvh.buildMs;
+                }
+            }
+            surf = createInstance(mesh, copy.second, surf.shapeIdx);
+        }
+        stats.instances += shared[m]->copies.size();
+    }
+    stats.meshes = shared.size();
+
+    // surfaces without copies are built as usual
+    for (Surface &surf : surfaces)
+    {
+        if (surf.mesh == NULL && !isBuilt(surf))
+            surf.PopulateBVH(surf.bvh.settings);
+    }
+
+    auto finishTime = std::chrono::high_resolution_clock::now();
+    stats.ms = std::chrono::duration<double, std::milli>(finishTime - startTime).count();
+    return stats;
+}
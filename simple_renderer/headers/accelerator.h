@@ -0,0 +1,112 @@
+#pragma once
+
+#include "surface.h"
+
+#include <map>
+#include <memory>
+
+struct Scene;
+struct Integrator;
+
+// Build statistics of an accelerator
+struct AcceleratorStats {
+    double buildMs = 0;
+    size_t nodes = 0; // nodes of the structure over the surfaces
+    size_t bytes = 0; // memory of the structure over the surfaces; per-surface BVHs count as geometry
+};
+
+// Structure that answers the ray queries of a scene, selected by name from the
+// registry below. Concrete accelerators derive from AcceleratorImpl and are
+// final, so the render loop instantiated for them calls them without virtual dispatch.
+struct Accelerator {
+    std::string name;
+    AcceleratorStats stats;
+
+    virtual ~Accelerator() {}
+
+    // build over the surfaces of the scene, which must stay in place afterwards
+    virtual void build(Scene& scene) = 0;
+    // update after surfaces of the scene were deformed, see Surface::updateVertices
+    virtual void refit(Scene& /*scene*/) {}
+
+    virtual Interaction rayIntersect(Ray& ray) = 0; // closest hit, shrinks ray.t
+    virtual bool occluded(const Ray& ray) = 0; // whether anything is hit in [0, ray.t]
+
+    // closest hits of a packet of coherent rays, only the rays in the active mask are traced
+    virtual void rayIntersect4(Ray rays[4], Interaction si[4], int active) = 0;
+    virtual void rayIntersect8(Ray rays[8], Interaction si[8], int active) = 0;
+    virtual void rayIntersect16(Ray rays[16], Interaction si[16], int active) = 0;
+
+    // render one tile with the render loop instantiated for the concrete accelerator
+    virtual void renderTile(Integrator& integrator, int tile) = 0;
+};
+
+// Packet queries and render loop of a concrete accelerator. Packets are traced
+// one ray at a time unless Derived provides its own rayIntersectPacket<N>.
+// renderTile is defined in render.h next to the render loop.
+template <typename Derived>
+struct AcceleratorImpl : Accelerator {
+    template <int N>
+    void rayIntersectPacket(Ray rays[N], Interaction si[N], int active)
+    {
+        for (int k = 0; k < N; ++k)
+        {
+            si[k] = Interaction();
+            if (active & (1 << k))
+                si[k] = static_cast<Derived*>(this)->rayIntersect(rays[k]);
+        }
+    }
+
+    void rayIntersect4(Ray rays[4], Interaction si[4], int active) override { static_cast<Derived*>(this)->template rayIntersectPacket<4>(rays, si, active); }
+    void rayIntersect8(Ray rays[8], Interaction si[8], int active) override { static_cast<Derived*>(this)->template rayIntersectPacket<8>(rays, si, active); }
+    void rayIntersect16(Ray rays[16], Interaction si[16], int active) override { static_cast<Derived*>(this)->template rayIntersectPacket<16>(rays, si, active); }
+
+    void renderTile(Integrator& integrator, int tile) override;
+};
+
+// Every face of every surface, with the double precision reference triangle test
+struct NaiveAccelerator final : AcceleratorImpl<NaiveAccelerator> {
+    std::vector<Surface*> surfaces;
+
+    void build(Scene& scene) override;
+    Interaction rayIntersect(Ray& ray) override;
+    bool occluded(const Ray& ray) override;
+};
+
+// Every face of the surfaces whose bounding box the ray enters
+struct AABBAccelerator final : AcceleratorImpl<AABBAccelerator> {
+    std::vector<Surface*> surfaces;
+
+    void build(Scene& scene) override;
+    Interaction rayIntersect(Ray& ray) override;
+    bool occluded(const Ray& ray) override;
+};
+
+// Median split BVH over the surfaces. Its leaves intersect their surface with
+// every face (bvh) or with the triangle BVH of the surface (two_level_bvh).
+template <bool TwoLevel>
+struct BVHAccelerator final : AcceleratorImpl<BVHAccelerator<TwoLevel>> {
+    BVH_object bvh;
+
+    BVHAccelerator();
+    ~BVHAccelerator();
+
+    void build(Scene& scene) override;
+    void refit(Scene& scene) override; // refits the boxes, the tree over the surfaces stays
+    Interaction rayIntersect(Ray& ray) override;
+    bool occluded(const Ray& ray) override;
+    template <int N>
+    void rayIntersectPacket(Ray rays[N], Interaction si[N], int active);
+
+    void PopulateBVH(BVH_object* bvh);
+    void PrintBVH(BVH_object* bvh, int lvl);
+    Interaction Traverse_BVH(Ray& ray, BVH_object* root);
+    template <int N>
+    void Traverse_BVHPacket(Ray rays[], RayPacket<N>& packet, int active, Interaction si[]);
+};
+
+// Accelerators by name, for "accelerator" in the scene file and on the command line
+typedef std::shared_ptr<Accelerator> (*AcceleratorFactory)();
+std::map<std::string, AcceleratorFactory>& acceleratorRegistry();
+bool registerAccelerator(const std::string& name, AcceleratorFactory factory); // false if the name is taken
+std::shared_ptr<Accelerator> createAccelerator(const std::string& name);
@@ -3,6 +3,20 @@
 #include "common.h"
 
 #define PRECISION 1024
+
+// Directions of a batch of camera rays in SoA form, filled by Camera::generateRays.
+// All camera rays start at Camera::from.
+struct CameraRays {
+    std::vector<double> dir[3], invDir[3];
+
+    void resize(size_t count) {
+        for (int a = 0; a < 3; ++a) {
+            dir[a].resize(count);
+            invDir[a].resize(count);
+        }
+    }
+};
+
 struct Camera {
     Vector3f from, to, up;
     float fieldOfView;
@@ -14,9 +28,26 @@ struct Camera {
     Vector3f u, v, w;
     Vector3f pixelDeltaU, pixelDeltaV;
     Vector3f upperLeft;
+    Vector3f toUpperLeft; // upperLeft - from, the same for every ray
 
     Camera() {};
     Camera(Vector3f from, Vector3f to, Vector3f up, float fieldOfView, Vector2i imageResolution);
 
-    Ray generateRay(int x, int y);
+    Ray generateRay(int x, int y) const;
+
+    // Rays through the count pixels from (x, y) to the right, stored from rays[first] on.
+    // The directions are the same as those of generateRay, bit for bit.
+    void generateRays(int x, int y, int count, CameraRays& rays, size_t first) const;
+
+    // Ray k of a batch
+    Ray ray(const CameraRays& rays, size_t k) const {
+        Ray ray;
+        ray.o = this->from;
+        for (int a = 0; a < 3; ++a) {
+            ray.d[a] = rays.dir[a][k];
+            ray.invDir[a] = rays.invDir[a][k];
+            ray.sign[a] = ray.invDir[a] < 0;
+        }
+        return ray;
+    }
 };
\ No newline at end of file
@@ -5,28 +5,82 @@
 #include <vector>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
 #include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 
 #include "vec.h"
 
-#include "json/include/nlohmann/json.hpp"
-
 // #define M_PI 3.14159263f
 
 struct Ray {
     Vector3f o, d;
+    Vector3f invDir; // 1 / d, infinite for zero components
+    int sign[3]; // 1 if the direction is negative along the axis: the ray enters a box through its maximum
     float t = 1e30f;
     float tmax = 1e30f;
 
 
+    Ray() {};
     Ray(Vector3f origin, Vector3f direction, float t = 1e30f, float tmax = 1e30f)
-        : o(origin), d(direction), t(t), tmax(tmax) {};
+        : o(origin), d(direction), t(t), tmax(tmax) {
+        for (int i = 0; i < 3; ++i) {
+            invDir[i] = 1.0 / d[i];
+            sign[i] = invDir[i] < 0;
+        }
+    };
 };
 
+// Slab test shared by all box types: aabb[0] is the minimum and aabb[1] the maximum
+// corner, indexed [corner][axis]. Only the part of the ray in front of the origin and
+// before the closest hit counts. Returns whether the ray enters the box and where.
+template <typename Bounds>
+inline bool slabTest(const Ray& ray, const Bounds& aabb, float& tEntry) {
+    float tmin = 0.f, tmax = ray.t;
+    for (int i = 0; i < 3; ++i) {
+        float t0 = (aabb[ray.sign[i]][i] - ray.o[i]) * ray.invDir[i];
+        float t1 = (aabb[1 - ray.sign[i]][i] - ray.o[i]) * ray.invDir[i];
+        // a zero direction with the origin on the plane gives 0 * inf = NaN, which fails
+        // both comparisons and leaves the interval unchanged
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+    }
+    tEntry = tmin;
+    return tmin <= tmax;
+}
+
+// Distance from |f| to the next float up, 2^(exponent - 23) from the exponent bits. Below the
+// normal range it is FLT_MIN instead of the denormal step: a wider pad is still conservative,
+// and denormal pads (an origin at 0) make every multiplication with them slow.
+inline float floatUlp(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits &= 0x7f800000u;
+    float power;
+    memcpy(&power, &bits, sizeof(power));
+    return std::max(power * FLT_EPSILON, FLT_MIN);
+}
+
 struct Interaction {
     Vector3f p, n;
     float t = 1e30f;
     bool didIntersect = false;
 };
 
-extern int intersection_type;
\ No newline at end of file
+// Per-render traversal counters
+struct RayStats {
+    uint64_t rays = 0;
+    uint64_t nodeTests = 0; // BVH node and surface bounding box tests
+    uint64_t triangleTests = 0;
+
+    RayStats& operator+=(const RayStats& other) {
+        rays += other.rays;
+        nodeTests += other.nodeTests;
+        triangleTests += other.triangleTests;
+        return *this;
+    }
+};
+
+extern thread_local RayStats ray_stats; // counters of the calling render thread
\ No newline at end of file
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "surface.h"
+
+// What deduplicateSurfaces found and saved
+struct DedupStats {
+    size_t instances = 0; // surfaces replaced by instances, the first copy of every mesh included
+    size_t meshes = 0; // meshes these instances share
+    size_t bytesSaved = 0; // geometry and BVH memory of the copies that are no longer stored
+    double buildMsSaved = 0; // BVH build time of the copies that were not built, estimated from their mesh
+    double ms = 0; // time of the pass, including the BVH builds it does
+};
+
+// Find surfaces with the same faces, uvs, material and BVH settings whose vertices and normals
+// agree up to a rigid transform (rotation and translation), as OBJ exporters write copies of one
+// mesh baked into world space. Every group of copies is replaced by one mesh, appended to meshes,
+// and instances of it in place of the copies. Surfaces that were loaded without a BVH are built
+// here if they are the mesh of a group or have no copies. Nothing may point into meshes yet.
+DedupStats deduplicateSurfaces(std::vector<Surface>& surfaces, std::vector<Surface>& meshes);
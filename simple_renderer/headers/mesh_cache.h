@@ -0,0 +1,27 @@
+#pragma once
+
+#include "surface.h"
+
+// Binary cache of the surfaces of an OBJ file: vertices, faces in BVH order,
+// flattened triangle BVH and triangle records. It is stored next to the OBJ as
+// <obj>.cache and is only used if it was written by the same cache version, for
+// the same OBJ and MTL contents and the same BVH settings.
+#define MESH_CACHE_VERSION 3
+
+// FNV-1a hash of a block of bytes, continuing from hash
+uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// Hash of the settings that change the built tree; threads, refitThreshold and cache do not
+uint64_t hashBVHSettings(const BVHSettings& settings);
+
+// Hash of the OBJ file and the MTL files it references
+uint64_t hashObj(const std::string& pathToObj);
+
+// Load the surfaces of pathToObj from its cache file. Returns false, leaving
+// surfaces unchanged, if there is no valid cache file for objHash and settings.
+bool loadMeshCache(const std::string& pathToObj, uint64_t objHash, const BVHSettings& settings,
+                   bool isLight, uint32_t shapeIdx, std::vector<Surface>& surfaces);
+
+// Write the numSurfaces surfaces of pathToObj, built with settings, to its cache file
+void saveMeshCache(const std::string& pathToObj, uint64_t objHash, const BVHSettings& settings,
+                   const Surface* surfaces, size_t numSurfaces);
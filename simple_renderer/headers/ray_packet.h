@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+#include "simd.h"
+
+#include <bitset>
+
+// N coherent rays in SoA form, traversed together with one SIMD slab test per node.
+// Rays are tracked by a bit mask; bit k stands for ray k of the packet.
+template <int N>
+struct RayPacket {
+    float org[3][N];
+    float invDir[3][N];
+    float pad[3][N]; // per-axis widening of the slabs that covers rounding the origin to float
+    float t[N]; // closest hit of every ray so far, kept in sync with Ray::t
+
+    RayPacket(const Ray rays[N]);
+};
+
+// Slab test of the active rays of a packet against one box. Returns the mask
+// of active rays that enter the box in [0, t] and stores their entry distance.
+// Like slabTestWide the test is conservative: rounding can add hits but never lose one.
+template <int N>
+int slabTestPacket(const float bmin[3], const float bmax[3], const RayPacket<N>& packet, int active, float tEntry[N]);
+
+template <>
+inline int slabTestPacket<4>(const float bmin[3], const float bmax[3], const RayPacket<4>& packet, int active, float tEntry[4])
+{
+    return simdKernels.slabTestPacket4(bmin, bmax, packet, active, tEntry);
+}
+template <>
+inline int slabTestPacket<8>(const float bmin[3], const float bmax[3], const RayPacket<8>& packet, int active, float tEntry[8])
+{
+    return simdKernels.slabTestPacket8(bmin, bmax, packet, active, tEntry);
+}
+template <>
+inline int slabTestPacket<16>(const float bmin[3], const float bmax[3], const RayPacket<16>& packet, int active, float tEntry[16])
+{
+    return simdKernels.slabTestPacket16(bmin, bmax, packet, active, tEntry);
+}
+
+// Same for a double precision box, which is rounded outwards first
+template <int N>
+int slabTestPacket(const Vector3f aabb[2], const RayPacket<N>& packet, int active, float tEntry[N]);
+
+// Once at most a quarter of the rays are left, tracing them one by one is cheaper
+template <int N>
+inline bool packetDiverged(int active) { return std::bitset<N>(active).count() * 4 <= N; }
+
+// Index of the lowest active ray
+inline int firstRay(int active)
+{
+    int k = 0;
+    while (!(active & (1 << k)))
+        k++;
+    return k;
+}
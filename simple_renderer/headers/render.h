@@ -2,11 +2,124 @@
 
 #include "scene.h"
 
+// Load balance of one render thread
+struct WorkerStats {
+    int tiles = 0;
+    int stolen = 0; // tiles taken from other workers
+    double busyMs = 0; // time spent rendering tiles
+    double idleMs = 0; // rest of the render time: scheduling, stealing and waiting for the others
+};
+
 struct Integrator {
     Integrator(Scene& scene);
 
     long long render();
 
-    Scene scene;
+    // Render loops for one concrete accelerator type, so rays are traced
+    // without virtual calls. Entered through Accelerator::renderTile.
+    template <typename Accel>
+    void renderTile(Accel& accel, int tile);
+    template <typename Accel, int N>
+    void renderPackets(Accel& accel, const CameraRays& cameraRays, int x0, int y0, int x1, int y1);
+
+    Scene& scene;
     Texture outputImage;
+
+    int numThreads;
+    Vector2i numTiles;
+    // pixels of a tile in the order of renderSettings.pixelOrder, or packet blocks with packets.
+    // Offsets from the tile corner, in pixels or in blocks; edge tiles skip those outside the image.
+    std::vector<Vector2i> tileOrder;
+    RayStats stats; // summed over all render threads
+    std::vector<WorkerStats> workerStats;
 };
+
+template <typename Accel>
+void Integrator::renderTile(Accel &accel, int tile)
+{
+    int tileSize = this->scene.renderSettings.tileSize;
+    int x0 = (tile % this->numTiles.x) * tileSize;
+    int y0 = (tile / this->numTiles.x) * tileSize;
+    int x1 = std::min(x0 + tileSize, this->scene.imageResolution.x);
+    int y1 = std::min(y0 + tileSize, this->scene.imageResolution.y);
+
+    // camera rays of the whole tile, one row of tileSize rays per pixel row
+    static thread_local CameraRays cameraRays;
+    cameraRays.resize(size_t(tileSize) * tileSize);
+    for (int y = y0; y < y1; y++)
+        this->scene.camera.generateRays(x0, y, x1 - x0, cameraRays, size_t(y - y0) * tileSize);
+
+    switch (this->scene.renderSettings.packetSize)
+    {
+        case 4:
+            this->renderPackets<Accel, 4>(accel, cameraRays, x0, y0, x1, y1);
+            return;
+        case 8:
+            this->renderPackets<Accel, 8>(accel, cameraRays, x0, y0, x1, y1);
+            return;
+        case 16:
+            this->renderPackets<Accel, 16>(accel, cameraRays, x0, y0, x1, y1);
+            return;
+    }
+
+    for (const Vector2i &offset : this->tileOrder) {
+        int x = x0 + offset.x, y = y0 + offset.y;
+        if (x >= x1 || y >= y1)
+            continue;
+
+        Ray cameraRay = this->scene.camera.ray(cameraRays, size_t(offset.y) * tileSize + offset.x);
+        ray_stats.rays++;
+        // std::cout << "cordinate :" << x << y  << "Camera ray: " << cameraRay.d.x << " " << cameraRay.d.y << " " << cameraRay.d.z << std::endl;
+        Interaction si = accel.rayIntersect(cameraRay);
+
+        if (si.didIntersect)
+            this->outputImage.writePixelColor(0.5f * (si.n + Vector3f(1.f, 1.f, 1.f)), x, y);
+        else
+            this->outputImage.writePixelColor(Vector3f(0.0f, 0.0f, 0.0f), x, y);
+    }
+}
+
+template <typename Accel, int N>
+void Integrator::renderPackets(Accel &accel, const CameraRays &cameraRays, int x0, int y0, int x1, int y1)
+{
+    int tileSize = this->scene.renderSettings.tileSize;
+    // 2x2, 4x2 or 4x4 pixel blocks; pixels of a block that fall outside the tile are left inactive
+    const int blockWidth = N == 4 ? 2 : 4;
+    const int blockHeight = N / blockWidth;
+    Ray rays[N];
+    Interaction si[N];
+
+    for (const Vector2i &offset : this->tileOrder) {
+        int bx = x0 + offset.x * blockWidth, by = y0 + offset.y * blockHeight;
+        if (bx >= x1 || by >= y1)
+            continue;
+
+        int active = 0;
+        for (int k = 0; k < N; k++) {
+            int x = bx + k % blockWidth, y = by + k / blockWidth;
+            if (x < x1 && y < y1) {
+                rays[k] = this->scene.camera.ray(cameraRays, size_t(y - y0) * tileSize + (x - x0));
+                active |= 1 << k;
+                ray_stats.rays++;
+            }
+        }
+
+        accel.template rayIntersectPacket<N>(rays, si, active);
+
+        for (int k = 0; k < N; k++) {
+            if (!(active & (1 << k)))
+                continue;
+            int x = bx + k % blockWidth, y = by + k / blockWidth;
+            if (si[k].didIntersect)
+                this->outputImage.writePixelColor(0.5f * (si[k].n + Vector3f(1.f, 1.f, 1.f)), x, y);
+            else
+                this->outputImage.writePixelColor(Vector3f(0.0f, 0.0f, 0.0f), x, y);
+        }
+    }
+}
+
+template <typename Derived>
+void AcceleratorImpl<Derived>::renderTile(Integrator &integrator, int tile)
+{
+    integrator.renderTile(static_cast<Derived &>(*this), tile);
+}
@@ -1,23 +1,77 @@
 #pragma once
 
 #include "camera.h"
-#include "surface.h" // contains BVH structure
+#include "accelerator.h"
+#include "dedup.h"
+#include "simd.h"
+
+#include "json/include/nlohmann/json.hpp"
+
+enum TileScheduler {
+    SCHEDULER_SHARED = 0, // workers take the next tile from one shared counter
+    SCHEDULER_STEALING,   // workers own a deque of tiles and steal from others when it runs dry
+};
+
+enum PixelOrder {
+    PIXEL_ORDER_COLUMNS = 0, // x outer, y inner
+    PIXEL_ORDER_ROWS,        // y outer, x inner
+    PIXEL_ORDER_MORTON,      // Z-order curve, neighbours in 2x2, 4x4, ... blocks are traced together
+    PIXEL_ORDER_HILBERT,     // Hilbert curve, every pixel is next to the one before
+};
+
+struct RenderSettings {
+    int threads = 0; // 0 uses every hardware thread
+    int tileSize = 32; // tiles are tileSize x tileSize pixels
+    TileScheduler scheduler = SCHEDULER_STEALING;
+    int packetSize = 16; // primary rays traced together: 1 (single rays), 4 (2x2 pixels), 8 (4x2) or 16 (4x4)
+    PixelOrder pixelOrder = PIXEL_ORDER_MORTON; // order of the pixels (or packets) within a tile
+    bool tiledFramebuffer = true; // store the image tile by tile, so a tile writes to contiguous memory
+    SimdLevel simd = SIMD_AUTO; // instruction set of the intersection kernels
+};
+
+RenderSettings parseRenderSettings(nlohmann::json renderConfig);
+std::string PixelOrderName(PixelOrder order);
+Transform parseTransform(nlohmann::json transformConfig);
 
 struct Scene {
-    std::vector<Surface> surfaces;
+    std::vector<Surface> surfaces; // surfaces with their own geometry, and instances of meshes
+    std::vector<Surface> meshes; // geometry shared by instances, not rendered by itself
     Camera camera;
     Vector2i imageResolution;
+    // world position of the coordinate origin of surfaces, camera and hit points: the camera
+    // position with "rebase": true, otherwise 0
+    Vector3f origin;
 
     Scene() {};
     Scene(std::string sceneDirectory, std::string sceneJson);
-    Scene(std::string pathToJson);
+    Scene(std::string pathToJson, nlohmann::json overrides = nlohmann::json::object());
     
     void parse(std::string sceneDirectory, nlohmann::json sceneConfig);
 
-    BVH_object bvh;
-    BVH_object* Traverse_BVH(Ray& ray);
-    void PopulateBVH(BVH_object* bvh);
-    void PrintBVH(BVH_object* bvh, int lvl);
+    BVHSettings bvhSettings;
+    RenderSettings renderSettings;
+
+    // replace surfaces that are rigidly moved copies of each other by instances of one mesh
+    bool deduplicate = false;
+    DedupStats dedupStats;
+
+    std::shared_ptr<Accelerator> accelerator; // built over surfaces, so the scene must not be copied or moved
+
+    // Move the vertices (in world coordinates) of a surface, e.g. for one frame of an animation. The triangle BVH of
+    // the surface is refit, or rebuilt once it has degraded too far (returns true then).
+    // Call refit() after the last surface of a frame has been updated.
+    bool updateVertices(size_t surfaceIdx, const std::vector<Vector3f>& vertices,
+                        const std::vector<Vector3f>& normals = std::vector<Vector3f>());
+    void refit(); // refit the accelerator to the updated surfaces
 
     Interaction rayIntersect(Ray& ray);
+
+    // Whether anything is hit before ray.tmax (and ray.t). Visibility queries such as shadow
+    // rays only need this: traversal stops at the first hit and no hit attributes are computed.
+    bool occluded(const Ray& ray);
+
+    // Closest hits of a packet of coherent rays. Only the rays in the active mask are traced.
+    void rayIntersect4(Ray rays[4], Interaction si[4], int active = 0xf) { this->accelerator->rayIntersect4(rays, si, active); }
+    void rayIntersect8(Ray rays[8], Interaction si[8], int active = 0xff) { this->accelerator->rayIntersect8(rays, si, active); }
+    void rayIntersect16(Ray rays[16], Interaction si[16], int active = 0xffff) { this->accelerator->rayIntersect16(rays, si, active); }
 };
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+struct TriangleArrays;
+struct WideBVHRay;
+template <int N>
+struct WideBVHNode;
+template <int N>
+struct QuantizedBVHNode;
+template <int N>
+struct RayPacket;
+
+// Instruction sets the intersection kernels are compiled for, from the oldest CPUs up
+enum SimdLevel {
+    SIMD_AUTO = -1, // the highest level the CPU supports
+    SIMD_SSE2 = 0,  // every x86-64 CPU
+    SIMD_SSE4,      // SSE4.1
+    SIMD_AVX2,
+    SIMD_AVX512,    // AVX-512F
+    NUM_SIMD_LEVELS,
+};
+
+// Traversal and triangle kernels of one instruction set, see simd_kernels.h. All levels give
+// the same results bit for bit, so images do not depend on the machine that renders them.
+struct SimdKernels {
+    SimdLevel level;
+    long int (*intersectTriangles)(const TriangleArrays& tris, const Ray& ray, uint32_t begin, uint32_t end, float tMax, float& tHit);
+    bool (*occludesTriangles)(const TriangleArrays& tris, const Ray& ray, uint32_t begin, uint32_t end, float tMax);
+    int (*slabTestWide4)(const WideBVHNode<4>& node, const WideBVHRay& ray, float tMax, float tEntry[4]);
+    int (*slabTestWide8)(const WideBVHNode<8>& node, const WideBVHRay& ray, float tMax, float tEntry[8]);
+    int (*slabTestQuantized4)(const QuantizedBVHNode<4>& node, const WideBVHRay& ray, float tMax, float tEntry[4]);
+    int (*slabTestQuantized8)(const QuantizedBVHNode<8>& node, const WideBVHRay& ray, float tMax, float tEntry[8]);
+    int (*slabTestPacket4)(const float bmin[3], const float bmax[3], const RayPacket<4>& packet, int active, float tEntry[4]);
+    int (*slabTestPacket8)(const float bmin[3], const float bmax[3], const RayPacket<8>& packet, int active, float tEntry[8]);
+    int (*slabTestPacket16)(const float bmin[3], const float bmax[3], const RayPacket<16>& packet, int active, float tEntry[16]);
+};
+
+// Kernels in use, the SSE2 ones until selectSimdKernels is called
+extern SimdKernels simdKernels;
+
+// Highest level that both the CPU (cpuid) and the operating system (saved AVX registers) support
+SimdLevel detectSimdLevel();
+
+// Use the kernels of level from now on, SIMD_AUTO picking the detected level. Exits if the
+// CPU cannot run them. Call it before rendering, as the render threads read simdKernels.
+void selectSimdKernels(SimdLevel level);
+
+std::string SimdLevelName(SimdLevel level);
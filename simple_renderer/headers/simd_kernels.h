@@ -0,0 +1,479 @@
+#pragma once
+
+// Traversal and triangle kernels, compiled once per instruction set by the kernels_<level>.cpp
+// files, which define SIMD_NAMESPACE and SIMD_LEVEL and get their compiler flags from
+// CMakeLists.txt. Everything here lives in SIMD_NAMESPACE; what it calls from shared headers
+// must be inlined (see FORCE_INLINE in vec.h), or the linker could keep an AVX build of it for
+// every caller. That is why only the plain structs of the headers below are included, and the
+// std::vector arrays of the records come in as pointers (TriangleArrays). Each level rounds
+// exactly like SSE2, only the width of the registers differs.
+
+#include "ray_packet.h"
+#include "triangles.h"
+#include "wide_bvh.h"
+
+#include <cfloat>
+#include <cstring>
+
+// relative slack on the entry distance that absorbs the rounding of the subtraction and multiplication
+#define SLAB_TEST_SLACK (1.f - 4.f * FLT_EPSILON)
+
+namespace SIMD_NAMESPACE {
+
+// Ray in the frame and precision of the records
+struct TriangleRay {
+    float o[3], d[3];
+
+    TriangleRay(const TriangleArrays &tris, const Ray &ray)
+    {
+        // the ray origin relative to the surface is exact enough in float once the large offsets cancel in double
+        this->o[0] = float(ray.o.x - tris.origin.x);
+        this->o[1] = float(ray.o.y - tris.origin.y);
+        this->o[2] = float(ray.o.z - tris.origin.z);
+        this->d[0] = float(ray.d.x);
+        this->d[1] = float(ray.d.y);
+        this->d[2] = float(ray.d.z);
+    }
+};
+
+// Moller-Trumbore test of the ray against the records [i, min(i + 4, end)).
+// Returns the mask of triangles hit at t <= tMax and stores the distances in t.
+static int intersectGroup(const TriangleArrays &tris, const TriangleRay &ray, uint32_t i, uint32_t end, float tMax, float t[4])
+{
+#ifdef VEC_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    Vec3x4 d(ray.d[0], ray.d[1], ray.d[2]);
+    Vec3x4 e1 = Vec3x4::load(tris.e1, i);
+    Vec3x4 e2 = Vec3x4::load(tris.e2, i);
+
+    // p = d x e2, det = e1 . p
+    Vec3x4 p = Cross(d, e2);
+    __m128 invDet = _mm_div_ps(one, Dot(e1, p));
+
+    // s = o - v0, u = (s . p) / det
+    Vec3x4 s = Vec3x4(ray.o[0], ray.o[1], ray.o[2]) - Vec3x4::load(tris.v0, i);
+    __m128 u = _mm_mul_ps(Dot(s, p), invDet);
+
+    // q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+    Vec3x4 q = Cross(s, e1);
+    __m128 v = _mm_mul_ps(Dot(d, q), invDet);
+    __m128 tHit = _mm_mul_ps(Dot(e2, q), invDet);
+
+    // comparisons with NaN are false, so degenerate triangles (det = 0) never hit
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(tHit, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(tHit, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(t, tHit);
+    int mask = _mm_movemask_ps(valid);
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; ++k)
+    {
+        float e1[3] = {tris.e1[0][i + k], tris.e1[1][i + k], tris.e1[2][i + k]};
+        float e2[3] = {tris.e2[0][i + k], tris.e2[1][i + k], tris.e2[2][i + k]};
+        float s[3] = {ray.o[0] - tris.v0[0][i + k], ray.o[1] - tris.v0[1][i + k], ray.o[2] - tris.v0[2][i + k]};
+        const float *d = ray.d;
+
+        float p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+        float invDet = 1.f / (e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2]);
+        float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+
+        float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+        float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+        t[k] = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+
+        mask |= (u >= 0.f && v >= 0.f && u + v <= 1.f && t[k] >= 0.f && t[k] <= tMax) << k;
+    }
+#endif
+
+    // the padding past the last record is not a triangle
+    if (end - i < 4)
+    {
+        mask &= (1 << (end - i)) - 1;
+    }
+    return mask;
+}
+
+static long int intersectTriangles(const TriangleArrays &tris, const Ray &ray, uint32_t begin, uint32_t end, float tMax, float &tHit)
+{
+    TriangleRay localRay(tris, ray);
+    long int hit = -1;
+
+    for (uint32_t i = begin; i < end; i += 4)
+    {
+        float t[4];
+        int mask = intersectGroup(tris, localRay, i, end, tMax, t);
+
+        // the last of equally distant hits wins, as in Surface::rayIntersectFaces
+        for (int k = 0; mask && k < 4; ++k)
+        {
+            if ((mask & (1 << k)) && t[k] <= tMax)
+            {
+                tMax = t[k];
+                hit = i + k;
+            }
+        }
+    }
+
+    tHit = tMax;
+    return hit;
+}
+
+static bool occludesTriangles(const TriangleArrays &tris, const Ray &ray, uint32_t begin, uint32_t end, float tMax)
+{
+    TriangleRay localRay(tris, ray);
+
+    for (uint32_t i = begin; i < end; i += 4)
+    {
+        float t[4];
+        if (intersectGroup(tris, localRay, i, end, tMax, t))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <int N>
+static int slabTestScalar(const WideBVHNode<N> &node, const WideBVHRay &ray, float tMax, float tEntry[N])
+{
+    int mask = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        float tNear = 0.f, tFar = tMax;
+        for (int a = 0; a < 3; ++a)
+        {
+            float nearPlane = ray.invDir[a] >= 0.f ? node.bmin[a][k] : node.bmax[a][k];
+            float farPlane = ray.invDir[a] >= 0.f ? node.bmax[a][k] : node.bmin[a][k];
+            float t0 = (nearPlane - ray.org[a]) * ray.invDir[a] - ray.pad[a];
+            float t1 = (farPlane - ray.org[a]) * ray.invDir[a] + ray.pad[a];
+            // comparisons with NaN are false, so it leaves the interval unchanged
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tEntry[k] = tNear;
+        mask |= (tNear * SLAB_TEST_SLACK <= tFar) << k;
+    }
+    return mask;
+}
+
+#ifdef VEC_SSE
+// Slab test of four boxes, given by the planes the ray enters them through (the minimum for a
+// positive direction and the maximum otherwise) and the planes it leaves them through
+static inline int slabTest4(const Vec3x4 &nearPlane, const Vec3x4 &farPlane, const WideBVHRay &ray, float tMax, float tEntry[4])
+{
+    Vec3x4 o(ray.org[0], ray.org[1], ray.org[2]);
+    Vec3x4 inv(ray.invDir[0], ray.invDir[1], ray.invDir[2]);
+    Vec3x4 pad(ray.pad[0], ray.pad[1], ray.pad[2]);
+    Vec3x4 t0 = (nearPlane - o) * inv - pad;
+    Vec3x4 t1 = (farPlane - o) * inv + pad;
+    // max/min return the second operand if either is NaN, so NaN leaves the interval unchanged
+    __m128 tNear = _mm_max_ps(t0.z, _mm_max_ps(t0.y, _mm_max_ps(t0.x, _mm_setzero_ps())));
+    __m128 tFar = _mm_min_ps(t1.z, _mm_min_ps(t1.y, _mm_min_ps(t1.x, _mm_set1_ps(tMax))));
+    _mm_storeu_ps(tEntry, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(tNear, _mm_set1_ps(SLAB_TEST_SLACK)), tFar));
+}
+
+// Near and far planes of the float child boxes [half, half + 4)
+template <int N>
+static inline void slabPlanes(const WideBVHNode<N> &node, const WideBVHRay &ray, int half, Vec3x4 &nearPlane, Vec3x4 &farPlane)
+{
+    const float *lo[3], *hi[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        lo[a] = (ray.invDir[a] >= 0.f ? node.bmin[a] : node.bmax[a]) + half;
+        hi[a] = (ray.invDir[a] >= 0.f ? node.bmax[a] : node.bmin[a]) + half;
+    }
+    nearPlane = Vec3x4::load(lo[0], lo[1], lo[2]);
+    farPlane = Vec3x4::load(hi[0], hi[1], hi[2]);
+}
+#endif
+
+#ifdef __AVX__
+// The same for eight boxes
+static inline int slabTest8(const Vec3x8 &nearPlane, const Vec3x8 &farPlane, const WideBVHRay &ray, float tMax, float tEntry[8])
+{
+    Vec3x8 o(ray.org[0], ray.org[1], ray.org[2]);
+    Vec3x8 inv(ray.invDir[0], ray.invDir[1], ray.invDir[2]);
+    Vec3x8 pad(ray.pad[0], ray.pad[1], ray.pad[2]);
+    Vec3x8 t0 = (nearPlane - o) * inv - pad;
+    Vec3x8 t1 = (farPlane - o) * inv + pad;
+    __m256 tNear = _mm256_max_ps(t0.z, _mm256_max_ps(t0.y, _mm256_max_ps(t0.x, _mm256_setzero_ps())));
+    __m256 tFar = _mm256_min_ps(t1.z, _mm256_min_ps(t1.y, _mm256_min_ps(t1.x, _mm256_set1_ps(tMax))));
+    _mm256_storeu_ps(tEntry, tNear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(tNear, _mm256_set1_ps(SLAB_TEST_SLACK)), tFar, _CMP_LE_OQ));
+}
+#endif
+
+static int slabTestWide(const WideBVHNode<4> &node, const WideBVHRay &ray, float tMax, float tEntry[4])
+{
+#ifdef VEC_SSE
+    Vec3x4 nearPlane, farPlane;
+    slabPlanes(node, ray, 0, nearPlane, farPlane);
+    return slabTest4(nearPlane, farPlane, ray, tMax, tEntry);
+#else
+    return slabTestScalar<4>(node, ray, tMax, tEntry);
+#endif
+}
+
+static int slabTestWide(const WideBVHNode<8> &node, const WideBVHRay &ray, float tMax, float tEntry[8])
+{
+#if defined(__AVX__)
+    const float *lo[3], *hi[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        lo[a] = ray.invDir[a] >= 0.f ? node.bmin[a] : node.bmax[a];
+        hi[a] = ray.invDir[a] >= 0.f ? node.bmax[a] : node.bmin[a];
+    }
+    return slabTest8(Vec3x8::load(lo[0], lo[1], lo[2]), Vec3x8::load(hi[0], hi[1], hi[2]), ray, tMax, tEntry);
+#elif defined(VEC_SSE)
+    // two SSE halves
+    int mask = 0;
+    for (int half = 0; half < 8; half += 4)
+    {
+        Vec3x4 nearPlane, farPlane;
+        slabPlanes(node, ray, half, nearPlane, farPlane);
+        mask |= slabTest4(nearPlane, farPlane, ray, tMax, tEntry + half) << half;
+    }
+    return mask;
+#else
+    return slabTestScalar<8>(node, ray, tMax, tEntry);
+#endif
+}
+
+// Slab test of the quantized children [half, half + 4), decoding their boxes on the fly
+#ifdef VEC_SSE
+template <int N>
+static int slabTestQuantizedSSE(const QuantizedBVHNode<N> &node, const WideBVHRay &ray, float tMax, float tEntry[N], int half)
+{
+    __m128 planes[2][3];
+    for (int a = 0; a < 3; ++a)
+    {
+        // four bytes widened to four floats, with the same rounding as dequantize
+        const uint8_t *nearPlane = ray.invDir[a] >= 0.f ? node.qmin[a] : node.qmax[a];
+        const uint8_t *farPlane = ray.invDir[a] >= 0.f ? node.qmax[a] : node.qmin[a];
+        int packedNear, packedFar;
+        memcpy(&packedNear, nearPlane + half, 4);
+        memcpy(&packedFar, farPlane + half, 4);
+#ifdef __SSE4_1__
+        __m128 qNear = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packedNear)));
+        __m128 qFar = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packedFar)));
+#else
+        __m128i zero = _mm_setzero_si128();
+        __m128 qNear = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedNear), zero), zero));
+        __m128 qFar = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedFar), zero), zero));
+#endif
+        __m128 origin = _mm_set1_ps(node.origin[a]);
+        __m128 step = _mm_set1_ps(quantizationStep(node.exponent[a]));
+        planes[0][a] = _mm_add_ps(origin, _mm_mul_ps(qNear, step));
+        planes[1][a] = _mm_add_ps(origin, _mm_mul_ps(qFar, step));
+    }
+    Vec3x4 nearPlane(planes[0][0], planes[0][1], planes[0][2]);
+    Vec3x4 farPlane(planes[1][0], planes[1][1], planes[1][2]);
+    return slabTest4(nearPlane, farPlane, ray, tMax, tEntry + half) << half;
+}
+#endif
+
+// All eight quantized children at once
+#ifdef __AVX2__
+static int slabTestQuantizedAVX2(const QuantizedBVHNode<8> &node, const WideBVHRay &ray, float tMax, float tEntry[8])
+{
+    __m256 planes[2][3];
+    for (int a = 0; a < 3; ++a)
+    {
+        const uint8_t *nearPlane = ray.invDir[a] >= 0.f ? node.qmin[a] : node.qmax[a];
+        const uint8_t *farPlane = ray.invDir[a] >= 0.f ? node.qmax[a] : node.qmin[a];
+        __m256 qNear = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(nearPlane))));
+        __m256 qFar = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(farPlane))));
+        __m256 origin = _mm256_set1_ps(node.origin[a]);
+        __m256 step = _mm256_set1_ps(quantizationStep(node.exponent[a]));
+        planes[0][a] = _mm256_add_ps(origin, _mm256_mul_ps(qNear, step));
+        planes[1][a] = _mm256_add_ps(origin, _mm256_mul_ps(qFar, step));
+    }
+    Vec3x8 nearPlane(planes[0][0], planes[0][1], planes[0][2]);
+    Vec3x8 farPlane(planes[1][0], planes[1][1], planes[1][2]);
+    return slabTest8(nearPlane, farPlane, ray, tMax, tEntry);
+}
+#endif
+
+// Decode the child boxes of a quantized node into the float layout
+#ifndef VEC_SSE
+template <int N>
+static void dequantizeNode(const QuantizedBVHNode<N> &node, WideBVHNode<N> &boxes)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        float step = quantizationStep(node.exponent[a]);
+        for (int k = 0; k < N; ++k)
+        {
+            boxes.bmin[a][k] = dequantize(node.origin[a], node.qmin[a][k], step);
+            boxes.bmax[a][k] = dequantize(node.origin[a], node.qmax[a][k], step);
+        }
+    }
+}
+#endif
+
+template <int N>
+static int occupiedChildren(const QuantizedBVHNode<N> &node)
+{
+    int mask = node.interior;
+    for (int k = 0; k < N; ++k)
+    {
+        mask |= (node.Num_Of_Triangles[k] != 0) << k;
+    }
+    return mask;
+}
+
+static int slabTestWide(const QuantizedBVHNode<4> &node, const WideBVHRay &ray, float tMax, float tEntry[4])
+{
+#ifdef VEC_SSE
+    return slabTestQuantizedSSE(node, ray, tMax, tEntry, 0) & occupiedChildren(node);
+#else
+    WideBVHNode<4> boxes;
+    dequantizeNode(node, boxes);
+    return slabTestScalar<4>(boxes, ray, tMax, tEntry) & occupiedChildren(node);
+#endif
+}
+
+static int slabTestWide(const QuantizedBVHNode<8> &node, const WideBVHRay &ray, float tMax, float tEntry[8])
+{
+#if defined(__AVX2__)
+    return slabTestQuantizedAVX2(node, ray, tMax, tEntry) & occupiedChildren(node);
+#elif defined(VEC_SSE)
+    int mask = slabTestQuantizedSSE(node, ray, tMax, tEntry, 0) | slabTestQuantizedSSE(node, ray, tMax, tEntry, 4);
+    return mask & occupiedChildren(node);
+#else
+    WideBVHNode<8> boxes;
+    dequantizeNode(node, boxes);
+    return slabTestScalar<8>(boxes, ray, tMax, tEntry) & occupiedChildren(node);
+#endif
+}
+
+#ifdef SIMD_AVX512_PACKETS
+// The AVX-512 level compiles everything else with AVX2: given the whole file, the compiler also
+// spills to zmm16-31, which vzeroupper leaves dirty, and the SSE code of the rest of the program
+// then runs several times slower. Only this test is built for AVX-512F (MSVC needs no flag for
+// the intrinsics); a 4x4 packet fills one register.
+#if defined(_MSC_VER)
+#define AVX512_FUNCTION
+#else
+#define AVX512_FUNCTION __attribute__((target("avx512f")))
+#endif
+
+AVX512_FUNCTION static int slabTestPacket16(const float bmin[3], const float bmax[3], const RayPacket<16> &packet, int active, float tEntry[16])
+{
+    __m512 zero = _mm512_setzero_ps();
+    __m512 tNear = zero;
+    __m512 tFar = _mm512_loadu_ps(packet.t);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m512 o = _mm512_loadu_ps(packet.org[a]);
+        __m512 inv = _mm512_loadu_ps(packet.invDir[a]);
+        __m512 pad = _mm512_loadu_ps(packet.pad[a]);
+        // rays with a negative direction enter through the maximum
+        __mmask16 negative = _mm512_cmp_ps_mask(inv, zero, _CMP_LT_OS);
+        __m512 lo = _mm512_set1_ps(bmin[a]);
+        __m512 hi = _mm512_set1_ps(bmax[a]);
+        __m512 t0 = _mm512_sub_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_mask_blend_ps(negative, lo, hi), o), inv), pad);
+        __m512 t1 = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_mask_blend_ps(negative, hi, lo), o), inv), pad);
+        tNear = _mm512_max_ps(t0, tNear);
+        tFar = _mm512_min_ps(t1, tFar);
+    }
+    _mm512_storeu_ps(tEntry, tNear);
+    return _mm512_cmp_ps_mask(_mm512_mul_ps(tNear, _mm512_set1_ps(SLAB_TEST_SLACK)), tFar, _CMP_LE_OQ) & active;
+}
+#endif
+
+template <int N>
+static int slabTestPacket(const float bmin[3], const float bmax[3], const RayPacket<N> &packet, int active, float tEntry[N])
+{
+    int mask = 0;
+    int base = 0;
+#ifdef __AVX__
+    for (; base + 8 <= N; base += 8)
+    {
+        if (!((active >> base) & 0xff))
+        {
+            continue;
+        }
+        Vec3x8 o = Vec3x8::load(packet.org, base);
+        Vec3x8 inv = Vec3x8::load(packet.invDir, base);
+        Vec3x8 pad = Vec3x8::load(packet.pad, base);
+        __m256 zero = _mm256_setzero_ps();
+        Vec3x8 negative(_mm256_cmp_ps(inv.x, zero, _CMP_LT_OS), _mm256_cmp_ps(inv.y, zero, _CMP_LT_OS), _mm256_cmp_ps(inv.z, zero, _CMP_LT_OS));
+        Vec3x8 lo(bmin[0], bmin[1], bmin[2]);
+        Vec3x8 hi(bmax[0], bmax[1], bmax[2]);
+        Vec3x8 t0 = (Select(negative, hi, lo) - o) * inv - pad;
+        Vec3x8 t1 = (Select(negative, lo, hi) - o) * inv + pad;
+        __m256 tNear = _mm256_max_ps(t0.z, _mm256_max_ps(t0.y, _mm256_max_ps(t0.x, zero)));
+        __m256 tFar = _mm256_min_ps(t1.z, _mm256_min_ps(t1.y, _mm256_min_ps(t1.x, _mm256_loadu_ps(packet.t + base))));
+        _mm256_storeu_ps(tEntry + base, tNear);
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(tNear, _mm256_set1_ps(SLAB_TEST_SLACK)), tFar, _CMP_LE_OQ)) << base;
+    }
+#endif
+#ifdef VEC_SSE
+    for (; base < N; base += 4)
+    {
+        // skip groups of four without an active ray
+        if (!((active >> base) & 0xf))
+        {
+            continue;
+        }
+        Vec3x4 o = Vec3x4::load(packet.org, base);
+        Vec3x4 inv = Vec3x4::load(packet.invDir, base);
+        Vec3x4 pad = Vec3x4::load(packet.pad, base);
+        // rays with a negative direction enter through the maximum
+        __m128 zero = _mm_setzero_ps();
+        Vec3x4 negative(_mm_cmplt_ps(inv.x, zero), _mm_cmplt_ps(inv.y, zero), _mm_cmplt_ps(inv.z, zero));
+        Vec3x4 lo(bmin[0], bmin[1], bmin[2]);
+        Vec3x4 hi(bmax[0], bmax[1], bmax[2]);
+        Vec3x4 t0 = (Select(negative, hi, lo) - o) * inv - pad;
+        Vec3x4 t1 = (Select(negative, lo, hi) - o) * inv + pad;
+        // max/min return the second operand if either is NaN, so NaN leaves the interval unchanged
+        __m128 tNear = _mm_max_ps(t0.z, _mm_max_ps(t0.y, _mm_max_ps(t0.x, zero)));
+        __m128 tFar = _mm_min_ps(t1.z, _mm_min_ps(t1.y, _mm_min_ps(t1.x, _mm_loadu_ps(packet.t + base))));
+        _mm_storeu_ps(tEntry + base, tNear);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(tNear, _mm_set1_ps(SLAB_TEST_SLACK)), tFar)) << base;
+    }
+#else
+    for (int k = base; k < N; ++k)
+    {
+        float tNear = 0.f, tFar = packet.t[k];
+        for (int a = 0; a < 3; ++a)
+        {
+            float nearPlane = packet.invDir[a][k] >= 0.f ? bmin[a] : bmax[a];
+            float farPlane = packet.invDir[a][k] >= 0.f ? bmax[a] : bmin[a];
+            float t0 = (nearPlane - packet.org[a][k]) * packet.invDir[a][k] - packet.pad[a][k];
+            float t1 = (farPlane - packet.org[a][k]) * packet.invDir[a][k] + packet.pad[a][k];
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tEntry[k] = tNear;
+        mask |= (tNear * SLAB_TEST_SLACK <= tFar) << k;
+    }
+#endif
+    return mask & active;
+}
+
+SimdKernels kernels()
+{
+    SimdKernels table;
+    table.level = SIMD_LEVEL;
+    table.intersectTriangles = intersectTriangles;
+    table.occludesTriangles = occludesTriangles;
+    table.slabTestWide4 = slabTestWide;
+    table.slabTestWide8 = slabTestWide;
+    table.slabTestQuantized4 = slabTestWide;
+    table.slabTestQuantized8 = slabTestWide;
+    table.slabTestPacket4 = slabTestPacket<4>;
+    table.slabTestPacket8 = slabTestPacket<8>;
+    table.slabTestPacket16 = slabTestPacket<16>;
+#ifdef SIMD_AVX512_PACKETS
+    table.slabTestPacket16 = slabTestPacket16;
+#endif
+    return table;
+}
+
+} // namespace SIMD_NAMESPACE
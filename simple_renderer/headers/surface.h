@@ -2,16 +2,91 @@
 
 #include "common.h"
 #include "texture.h"
+#include "wide_bvh.h"
+#include "ray_packet.h"
+#include "triangles.h"
+#include "transform.h"
+
+#include "json/include/nlohmann/json.hpp"
+
+enum BVHBuilder {
+    BVH_MEDIAN = 0, // object median split along the longest axis
+    BVH_SAH,        // binned surface area heuristic
+    BVH_LBVH,       // linear BVH over Morton-sorted centroids
+    BVH_SBVH,       // SAH with spatial splits that clip triangles into both children
+    NUM_BVH_BUILDERS
+};
+
+struct BVHSettings {
+    BVHBuilder builder = BVH_MEDIAN;
+    int bins = 16;          // number of SAH bins per axis
+    float leafCost = 1.f;   // cost of one triangle test relative to one traversal step
+    int maxLeafSize = 4;    // leaves are never larger than this, at most 65535
+    int width = 2;          // children per node: 2 (binary), 4 or 8 (collapsed, SIMD slab tests)
+    bool quantized = false; // 4- and 8-wide nodes store their child boxes in 8 bits per plane
+    int threads = 0;        // build threads, 0 uses every hardware thread
+    int mortonBits = 30;    // LBVH Morton code length: 30 or 63
+    int treeletSize = 0;    // LBVH treelet restructuring: leaves per treelet (3 to 8), 0 disables it
+    float duplicationBudget = 0.3f; // SBVH: extra triangle references allowed, as a fraction of the triangles
+    float spatialAlpha = 1e-5f;     // SBVH: try spatial splits where the object split children overlap by more than this fraction of the root area
+    float refitThreshold = 1.5f;    // deforming surfaces are rebuilt once refitting raises the SAH cost by this factor
+    bool cache = true;              // load the surfaces of an OBJ from <obj>.cache and write it after parsing and building
+};
+
+BVHSettings parseBVHSettings(nlohmann::json bvhConfig);
+std::string BVHBuilderName(BVHBuilder builder);
+
+// Traversal stacks are fixed size, builders keep the trees shallower than this
+#define BVH_STACK_SIZE 64
+
+// Node of the flattened triangle BVH (32 bytes). Nodes are stored depth-first,
+// so the left child of an interior node is always the next node in the array.
+struct BVHNode {
+    float aabb[2][3]; // Axis-aligned bounding box (min, max), rounded outwards
+    uint32_t offset; // leaf: first face in Surface::indices, interior: index of the right child
+    uint16_t Num_Of_Triangles; // 0 for interior nodes
+    uint8_t axis; // split axis of interior nodes
+    uint8_t pad;
 
+    bool isLeaf() const { return Num_Of_Triangles > 0; }
+    bool slab_test(const Ray& ray, float& tEntry) const { return slabTest(ray, aabb, tEntry); } // Axis-aligned bounding box intersection test
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should stay 32 bytes");
+
+// Faces of the surface are stored in BVH order, so every leaf references a
+// contiguous range of Surface::indices into the shared vertex/normal arrays
 struct BVH_Triangles {
-    BVH_Triangles* left;
-    BVH_Triangles* right;
-    std:: vector<Vector3f> vertices; // array of vertices in BVH Node
-    std:: vector<Vector3f> normals; // array of pointers to normals in BVH Node
-    long int Num_Of_Triangles;
-    Vector3f aabb[2]; // Axis-aligned bounding box (min, max)
+    std::vector<BVHNode> nodes; // nodes[0] is the root
+    int width = 2; // which of the layouts below is traversed
+    std::vector<WideBVHNode<4>> nodes4; // nodes collapsed 4-wide
+    std::vector<WideBVHNode<8>> nodes8; // nodes collapsed 8-wide
+    bool quantized = false; // whether the wide layout below replaces nodes4 or nodes8
+    std::vector<QuantizedBVHNode<4>> quantized4; // nodes collapsed 4-wide, quantized
+    std::vector<QuantizedBVHNode<8>> quantized8; // nodes collapsed 8-wide, quantized
+    BVHSettings settings; // settings the tree was built with, kept for rebuilds
+    double buildMs = 0; // time to build the tree, including the triangle records, or to load it from the mesh cache
+    double sahCost = 0; // SAH cost of the binary tree relative to its root area when it was built, lower is better
+    double refitSahCost = 0; // the same after the latest refit
+    int refits = 0; // refits since the tree was built
+    size_t duplicates = 0; // extra face references added by spatial splits
+    bool fromCache = false; // loaded from the mesh cache instead of built
+};
 
-    bool slab_test(Ray& ray); // Axis-aligned bounding box intersection test
+// Memory used by the geometry and BVH of a surface
+struct GeometryMemory {
+    size_t triangles = 0;
+    size_t bytes = 0;
+    size_t legacyBytes = 0; // same tree with per-node copies of the triangles
+    size_t nodeBytes = 0; // BVH nodes of the layout that is traversed
+
+    GeometryMemory& operator+=(const GeometryMemory& other) {
+        triangles += other.triangles;
+        bytes += other.bytes;
+        legacyBytes += other.legacyBytes;
+        nodeBytes += other.nodeBytes;
+        return *this;
+    }
 };
 
 struct Surface {
@@ -26,23 +101,53 @@ struct Surface {
     float alpha;
 
     Texture diffuseTexture, alphaTexture;
+    std::string diffuseTextureName, alphaTextureName; // relative to the OBJ, kept for the mesh cache
 
     Interaction rayPlaneIntersect(Ray ray, Vector3f p, Vector3f n);
     Interaction rayTriangleIntersect(Ray ray, Vector3f v1, Vector3f v2, Vector3f v3, Vector3f n);
-    Interaction rayIntersect(Ray ray);
+    Interaction rayIntersect(Ray ray); // closest hit through the triangle BVH
+    bool occluded(const Ray& ray); // whether anything is hit in [0, ray.t]; stops at the first hit and computes no hit attributes
+    Interaction rayIntersectFaces(Ray& ray, uint32_t begin, uint32_t end); // closest hit among indices[begin, end), reference test
+    Interaction rayIntersectLeaf(Ray& ray, uint32_t begin, uint32_t end); // same with the precomputed triangle records
+    bool occludedFaces(const Ray& ray); // any hit among all faces, reference test
+    bool occludedLeaf(const Ray& ray, uint32_t begin, uint32_t end); // any hit among indices[begin, end), triangle records
 
-    bool slab_test(Ray& ray); // Axis-aligned bounding box intersection test
+    bool slab_test(const Ray& ray, float& tEntry) const { return slabTest(ray, aabb, tEntry); } // Axis-aligned bounding box intersection test
 
     Vector3f aabb[2]; // Axis-aligned bounding box (min, max)
     
     bool isNull;
 
     BVH_Triangles bvh;
-
-    void PopulateBVH(BVH_Triangles* bvh);
-    void PrintBVH(BVH_Triangles* bvh, int lvl);
-    BVH_Triangles* Traverse_BVH(Ray& ray);
-    void UpdateAABB(BVH_Triangles* bvh);
+    TriangleRecords triangles; // faces in BVH order, built with the BVH
+
+    // Instance of a mesh that other instances share, NULL for a surface with its own geometry.
+    // An instance has no faces or BVH of its own: rays are moved into the object space of the
+    // mesh with toObject and traverse its BVH there. aabb is the world box of the instance.
+    Surface* mesh = NULL;
+    Transform toWorld, toObject;
+
+    void PopulateBVH(const BVHSettings& settings);
+    void PrintBVH(uint32_t node, int lvl);
+    Interaction Traverse_BVH(Ray& ray);
+    Interaction Traverse_BinaryBVH(Ray& ray, uint32_t root); // binary layout, from any subtree
+    template <int N, typename Node>
+    Interaction Traverse_WideBVH(Ray& ray, const std::vector<Node>& nodes); // WideBVHNode<N> or QuantizedBVHNode<N>
+    // closest hits of the active rays of a packet; updates rays, packet.t and si of every ray that hits
+    template <int N>
+    void Traverse_BVHPacket(Ray rays[], RayPacket<N>& packet, int active, Interaction si[]);
+    bool occludedBVH(const Ray& ray);
+    template <int N, typename Node>
+    bool occludedWideBVH(const Ray& ray, const std::vector<Node>& nodes);
+    void collapseBVH(); // rebuild the wide layout of bvh.width from the binary nodes
+    void buildTraversalData(); // rebuild the wide layout and the triangle records from the binary nodes and vertices
+    void UpdateAABB(); // refit the surface box and binary BVH to the current vertices, keeping the topology
+    void translate(const Vector3f& offset); // move the surface with its BVH, or the placement of an instance
+    // Replace the vertex positions (and normals, unless empty) of a deforming surface and refit its
+    // BVH, or rebuild it once refitting has degraded it past bvh.settings.refitThreshold.
+    // Returns whether the BVH was rebuilt.
+    bool updateVertices(const std::vector<Vector3f>& vertices, const std::vector<Vector3f>& normals = std::vector<Vector3f>());
+    GeometryMemory memoryUsage() const;
 
 
 private:
@@ -50,7 +155,11 @@ private:
     bool hasAlphaTexture();
 };
 
-std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx);
+// Parse the shapes of an OBJ file (or load them from its mesh cache). Without buildBVH the surfaces
+// that are parsed have no BVH yet, only bvh.settings, and are not written to the cache.
+std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx, const BVHSettings& bvhSettings,
+                                    bool buildBVH = true);
+Surface createInstance(Surface* mesh, const Transform& toWorld, uint32_t shapeIdx);
 
 // structure for BVH
 struct BVH_object {
@@ -60,6 +169,6 @@ struct BVH_object {
     long int Num_Of_Surfaces;
     Vector3f aabb[2]; // Axis-aligned bounding box (min, max)
 
-    bool slab_test(Ray& ray); // Axis-aligned bounding box intersection test
+    bool slab_test(const Ray& ray, float& tEntry) const { return slabTest(ray, aabb, tEntry); } // Axis-aligned bounding box intersection test
 };
 
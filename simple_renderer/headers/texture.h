@@ -13,12 +13,22 @@ struct Texture {
     TextureType type;
 
     Vector2i resolution;
+    int tileSize = 0; // > 0: pixels are stored tile by tile, in rows of tileSize within a tile
 
     Texture() {};
     Texture(std::string pathToImage);
 
-    void allocate(TextureType type, Vector2i resolution);
+    void allocate(TextureType type, Vector2i resolution, int tileSize = 0);
     void writePixelColor(Vector3f color, int x, int y);
+    void untile(); // store the pixels of a tiled texture in rows, as the image files do
+
+    size_t pixelIndex(int x, int y) const {
+        if (tileSize == 0)
+            return size_t(y) * resolution.x + x;
+        size_t tilesX = (resolution.x + tileSize - 1) / tileSize;
+        size_t tile = size_t(y / tileSize) * tilesX + x / tileSize;
+        return tile * tileSize * tileSize + (y % tileSize) * tileSize + x % tileSize;
+    }
     
     void loadJpg(std::string pathToJpg);
     void loadPng(std::string pathToPng);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+// Affine transform: the top three rows of a 4x4 matrix applied to column vectors
+struct Transform {
+    double m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    Vector3f point(const Vector3f& p) const {
+        return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f vector(const Vector3f& v) const {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // Normals transform with the inverse transpose, so this is called on the inverse
+    Vector3f normalFromInverse(const Vector3f& n) const {
+        return Normalize(Vector3f(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                                  m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                                  m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z));
+    }
+
+    double determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Inverse of a transform with a non-zero determinant
+    Transform inverse() const {
+        Transform inv;
+        double invDet = 1.0 / determinant();
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                // cofactor of m[j][i]
+                int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                inv.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * invDet;
+            }
+        }
+        for (int i = 0; i < 3; ++i)
+            inv.m[i][3] = -(inv.m[i][0] * m[0][3] + inv.m[i][1] * m[1][3] + inv.m[i][2] * m[2][3]);
+        return inv;
+    }
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "simd.h"
+
+// extra records at the end of every array, so the last group of four can always be loaded
+#define TRIANGLE_PADDING 3
+
+// The record arrays as plain pointers, which is how the kernels of simd.h take them: they are
+// built per instruction set and must not call std::vector code (see simd_kernels.h)
+struct TriangleArrays {
+    Vector3f origin;
+    const float* v0[3];
+    const float* e1[3];
+    const float* e2[3];
+};
+
+// Precomputed triangles of a surface for the single pass Moller-Trumbore test.
+// The records are SoA (one array per coordinate) in the order of
+// Surface::indices, so a BVH leaf is a range of consecutive records. Every
+// array is padded so that four records can be loaded from any offset.
+struct TriangleRecords {
+    Vector3f origin; // centre of the surface; vertices are stored relative to it to keep float precision far from the world origin
+    std::vector<float> v0[3]; // first vertex - origin
+    std::vector<float> e1[3]; // second vertex - first vertex
+    std::vector<float> e2[3]; // third vertex - first vertex
+    std::vector<Vector3f> normals; // shading normal of every face: its normalized vertex normal sum
+
+    void build(const std::vector<Vector3f>& vertices, const std::vector<Vector3f>& vertexNormals, const std::vector<Vector3i>& indices);
+    size_t bytes() const;
+    TriangleArrays arrays() const;
+};
+
+inline TriangleArrays TriangleRecords::arrays() const
+{
+    TriangleArrays view;
+    view.origin = this->origin;
+    for (int a = 0; a < 3; ++a)
+    {
+        view.v0[a] = this->v0[a].data();
+        view.e1[a] = this->e1[a].data();
+        view.e2[a] = this->e2[a].data();
+    }
+    return view;
+}
+
+// Closest of the triangles [begin, end) that the ray hits at t <= tMax. Returns
+// its index and stores its distance in tHit, or returns -1 if none is hit.
+// The test runs on four triangles at a time with the kernels of simd.h.
+inline long int intersectTriangles(const TriangleRecords& tris, const Ray& ray, uint32_t begin, uint32_t end, float tMax, float& tHit)
+{
+    return simdKernels.intersectTriangles(tris.arrays(), ray, begin, end, tMax, tHit);
+}
+
+// Whether any of the triangles [begin, end) is hit at t <= tMax; stops at the first hit
+inline bool occludesTriangles(const TriangleRecords& tris, const Ray& ray, uint32_t begin, uint32_t end, float tMax)
+{
+    return simdKernels.occludesTriangles(tris.arrays(), ray, begin, end, tMax);
+}
@@ -8,6 +8,21 @@
 #include <fstream>
 #include <chrono>
 #include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define VEC_SSE
+#endif
+
+// The SIMD types below are always inlined. The intersection kernels are compiled once per
+// instruction set (simd.h), and an out-of-line copy built for AVX could be picked by the
+// linker for the SSE2 kernels as well.
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
 
 template <typename T>
 inline bool isNaN(const T x) {
@@ -199,6 +214,16 @@ inline Vector3<T> Normalize(const Vector3<T>& v) {
     return v / v.Length();
 }
 
+template <typename T>
+inline Vector3<T> Min(const Vector3<T>& v1, const Vector3<T>& v2) {
+    return Vector3<T>(std::min(v1.x, v2.x), std::min(v1.y, v2.y), std::min(v1.z, v2.z));
+}
+
+template <typename T>
+inline Vector3<T> Max(const Vector3<T>& v1, const Vector3<T>& v2) {
+    return Vector3<T>(std::max(v1.x, v2.x), std::max(v1.y, v2.y), std::max(v1.z, v2.z));
+}
+
 template <typename T>
 inline float Dot(const Vector2<T>& v1, const Vector2<T>& v2) {
     return v1.x * v2.x + v1.y * v2.y;
@@ -217,3 +242,175 @@ template <typename T>
 Vector2<T> Abs(const Vector2<T>& v) {
     return Vector2<T>(std::abs(v.x), std::abs(v.y));
 }
+
+#ifdef VEC_SSE
+// Single precision 3-vector in one 16-byte aligned SSE register, the fourth lane kept at 0.
+// Arithmetic rounds like Vector3<float>: Dot adds x, y and z in that order, and Normalize
+// multiplies by the rounded inverse length.
+struct alignas(16) Vector3fa {
+    __m128 m;
+
+    FORCE_INLINE Vector3fa() : m(_mm_setzero_ps()) { }
+    explicit FORCE_INLINE Vector3fa(__m128 m) : m(m) { }
+    FORCE_INLINE Vector3fa(float x, float y, float z) : m(_mm_set_ps(0.f, z, y, x)) { }
+    explicit FORCE_INLINE Vector3fa(const Vector3<double>& v) : m(_mm_set_ps(0.f, float(v.z), float(v.y), float(v.x))) { }
+
+    // lanes are read through memory instead of branching on the index
+    FORCE_INLINE float operator[](int i) const {
+        alignas(16) float v[4];
+        _mm_store_ps(v, m);
+        return v[i];
+    }
+    FORCE_INLINE Vector3<double> toVector3f() const {
+        alignas(16) float v[4];
+        _mm_store_ps(v, m);
+        return Vector3<double>(v[0], v[1], v[2]);
+    }
+
+    FORCE_INLINE Vector3fa operator+(const Vector3fa& v) const { return Vector3fa(_mm_add_ps(m, v.m)); }
+    FORCE_INLINE Vector3fa operator-(const Vector3fa& v) const { return Vector3fa(_mm_sub_ps(m, v.m)); }
+    FORCE_INLINE Vector3fa operator*(const Vector3fa& v) const { return Vector3fa(_mm_mul_ps(m, v.m)); }
+    FORCE_INLINE Vector3fa operator*(float s) const { return Vector3fa(_mm_mul_ps(m, _mm_set1_ps(s))); }
+    FORCE_INLINE Vector3fa operator/(float f) const { return *this * (1.f / f); }
+    FORCE_INLINE Vector3fa operator-() const { return Vector3fa(_mm_sub_ps(_mm_setzero_ps(), m)); }
+    FORCE_INLINE Vector3fa& operator+=(const Vector3fa& v) { m = _mm_add_ps(m, v.m); return *this; }
+    FORCE_INLINE Vector3fa& operator-=(const Vector3fa& v) { m = _mm_sub_ps(m, v.m); return *this; }
+    FORCE_INLINE float LengthSquared() const;
+    FORCE_INLINE float Length() const { return std::sqrt(LengthSquared()); }
+};
+
+FORCE_INLINE float Dot(const Vector3fa& v1, const Vector3fa& v2) {
+    __m128 p = _mm_mul_ps(v1.m, v2.m);
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+}
+
+FORCE_INLINE float Vector3fa::LengthSquared() const { return Dot(*this, *this); }
+
+FORCE_INLINE Vector3fa Cross(const Vector3fa& v1, const Vector3fa& v2) {
+    // v1 * v2.yzx - v1.yzx * v2 is the cross product in the order z, x, y
+    __m128 a = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(v1.m, b), _mm_mul_ps(a, v2.m));
+    return Vector3fa(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+FORCE_INLINE Vector3fa Normalize(const Vector3fa& v) {
+    return v / v.Length();
+}
+
+FORCE_INLINE Vector3fa Min(const Vector3fa& v1, const Vector3fa& v2) { return Vector3fa(_mm_min_ps(v1.m, v2.m)); }
+FORCE_INLINE Vector3fa Max(const Vector3fa& v1, const Vector3fa& v2) { return Vector3fa(_mm_max_ps(v1.m, v2.m)); }
+
+// Four 3-vectors in SoA form, one SSE register per coordinate: four rays, boxes or triangles
+// are handled with the instructions of one. Operations work lane by lane and round like
+// Vector3<float>. Min and Max return the second operand in lanes where either is NaN.
+struct Vec3x4 {
+    __m128 x, y, z;
+
+    FORCE_INLINE Vec3x4() { }
+    FORCE_INLINE Vec3x4(__m128 x, __m128 y, __m128 z) : x(x), y(y), z(z) { }
+    // the same vector in every lane
+    FORCE_INLINE Vec3x4(float x, float y, float z) : x(_mm_set1_ps(x)), y(_mm_set1_ps(y)), z(_mm_set1_ps(z)) { }
+    explicit FORCE_INLINE Vec3x4(const Vector3fa& v)
+        : x(_mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(0, 0, 0, 0))),
+          y(_mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1))),
+          z(_mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(2, 2, 2, 2))) { }
+
+    // Lanes [i, i + 4) of SoA arrays, which need not be aligned
+    static FORCE_INLINE Vec3x4 load(const float* x, const float* y, const float* z) {
+        return Vec3x4(_mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z));
+    }
+    template <size_t N>
+    static FORCE_INLINE Vec3x4 load(const float (&soa)[3][N], size_t i) { return load(soa[0] + i, soa[1] + i, soa[2] + i); }
+    static FORCE_INLINE Vec3x4 load(const float* const soa[3], size_t i) { return load(soa[0] + i, soa[1] + i, soa[2] + i); }
+
+    FORCE_INLINE Vec3x4 operator+(const Vec3x4& v) const { return Vec3x4(_mm_add_ps(x, v.x), _mm_add_ps(y, v.y), _mm_add_ps(z, v.z)); }
+    FORCE_INLINE Vec3x4 operator-(const Vec3x4& v) const { return Vec3x4(_mm_sub_ps(x, v.x), _mm_sub_ps(y, v.y), _mm_sub_ps(z, v.z)); }
+    FORCE_INLINE Vec3x4 operator*(const Vec3x4& v) const { return Vec3x4(_mm_mul_ps(x, v.x), _mm_mul_ps(y, v.y), _mm_mul_ps(z, v.z)); }
+    FORCE_INLINE Vec3x4 operator*(__m128 s) const { return Vec3x4(_mm_mul_ps(x, s), _mm_mul_ps(y, s), _mm_mul_ps(z, s)); }
+};
+
+FORCE_INLINE __m128 Dot(const Vec3x4& v1, const Vec3x4& v2) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(v1.x, v2.x), _mm_mul_ps(v1.y, v2.y)), _mm_mul_ps(v1.z, v2.z));
+}
+
+FORCE_INLINE Vec3x4 Cross(const Vec3x4& v1, const Vec3x4& v2) {
+    return Vec3x4(_mm_sub_ps(_mm_mul_ps(v1.y, v2.z), _mm_mul_ps(v1.z, v2.y)),
+                  _mm_sub_ps(_mm_mul_ps(v1.z, v2.x), _mm_mul_ps(v1.x, v2.z)),
+                  _mm_sub_ps(_mm_mul_ps(v1.x, v2.y), _mm_mul_ps(v1.y, v2.x)));
+}
+
+FORCE_INLINE Vec3x4 Normalize(const Vec3x4& v) {
+    return v * _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(Dot(v, v)));
+}
+
+FORCE_INLINE Vec3x4 Min(const Vec3x4& v1, const Vec3x4& v2) {
+    return Vec3x4(_mm_min_ps(v1.x, v2.x), _mm_min_ps(v1.y, v2.y), _mm_min_ps(v1.z, v2.z));
+}
+
+FORCE_INLINE Vec3x4 Max(const Vec3x4& v1, const Vec3x4& v2) {
+    return Vec3x4(_mm_max_ps(v1.x, v2.x), _mm_max_ps(v1.y, v2.y), _mm_max_ps(v1.z, v2.z));
+}
+
+// Lanes of a where mask is set and of b elsewhere, mask being the result of a comparison
+FORCE_INLINE Vec3x4 Select(const Vec3x4& mask, const Vec3x4& a, const Vec3x4& b) {
+#ifdef __SSE4_1__
+    return Vec3x4(_mm_blendv_ps(b.x, a.x, mask.x), _mm_blendv_ps(b.y, a.y, mask.y), _mm_blendv_ps(b.z, a.z, mask.z));
+#else
+    return Vec3x4(_mm_or_ps(_mm_and_ps(mask.x, a.x), _mm_andnot_ps(mask.x, b.x)),
+                  _mm_or_ps(_mm_and_ps(mask.y, a.y), _mm_andnot_ps(mask.y, b.y)),
+                  _mm_or_ps(_mm_and_ps(mask.z, a.z), _mm_andnot_ps(mask.z, b.z)));
+#endif
+}
+#endif
+
+#ifdef __AVX__
+// Eight 3-vectors in SoA form with one AVX register per coordinate, as Vec3x4
+struct Vec3x8 {
+    __m256 x, y, z;
+
+    FORCE_INLINE Vec3x8() { }
+    FORCE_INLINE Vec3x8(__m256 x, __m256 y, __m256 z) : x(x), y(y), z(z) { }
+    FORCE_INLINE Vec3x8(float x, float y, float z) : x(_mm256_set1_ps(x)), y(_mm256_set1_ps(y)), z(_mm256_set1_ps(z)) { }
+
+    static FORCE_INLINE Vec3x8 load(const float* x, const float* y, const float* z) {
+        return Vec3x8(_mm256_loadu_ps(x), _mm256_loadu_ps(y), _mm256_loadu_ps(z));
+    }
+    template <size_t N>
+    static FORCE_INLINE Vec3x8 load(const float (&soa)[3][N], size_t i) { return load(soa[0] + i, soa[1] + i, soa[2] + i); }
+    static FORCE_INLINE Vec3x8 load(const float* const soa[3], size_t i) { return load(soa[0] + i, soa[1] + i, soa[2] + i); }
+
+    FORCE_INLINE Vec3x8 operator+(const Vec3x8& v) const { return Vec3x8(_mm256_add_ps(x, v.x), _mm256_add_ps(y, v.y), _mm256_add_ps(z, v.z)); }
+    FORCE_INLINE Vec3x8 operator-(const Vec3x8& v) const { return Vec3x8(_mm256_sub_ps(x, v.x), _mm256_sub_ps(y, v.y), _mm256_sub_ps(z, v.z)); }
+    FORCE_INLINE Vec3x8 operator*(const Vec3x8& v) const { return Vec3x8(_mm256_mul_ps(x, v.x), _mm256_mul_ps(y, v.y), _mm256_mul_ps(z, v.z)); }
+    FORCE_INLINE Vec3x8 operator*(__m256 s) const { return Vec3x8(_mm256_mul_ps(x, s), _mm256_mul_ps(y, s), _mm256_mul_ps(z, s)); }
+};
+
+FORCE_INLINE __m256 Dot(const Vec3x8& v1, const Vec3x8& v2) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v1.x, v2.x), _mm256_mul_ps(v1.y, v2.y)), _mm256_mul_ps(v1.z, v2.z));
+}
+
+FORCE_INLINE Vec3x8 Cross(const Vec3x8& v1, const Vec3x8& v2) {
+    return Vec3x8(_mm256_sub_ps(_mm256_mul_ps(v1.y, v2.z), _mm256_mul_ps(v1.z, v2.y)),
+                  _mm256_sub_ps(_mm256_mul_ps(v1.z, v2.x), _mm256_mul_ps(v1.x, v2.z)),
+                  _mm256_sub_ps(_mm256_mul_ps(v1.x, v2.y), _mm256_mul_ps(v1.y, v2.x)));
+}
+
+FORCE_INLINE Vec3x8 Normalize(const Vec3x8& v) {
+    return v * _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_sqrt_ps(Dot(v, v)));
+}
+
+FORCE_INLINE Vec3x8 Min(const Vec3x8& v1, const Vec3x8& v2) {
+    return Vec3x8(_mm256_min_ps(v1.x, v2.x), _mm256_min_ps(v1.y, v2.y), _mm256_min_ps(v1.z, v2.z));
+}
+
+FORCE_INLINE Vec3x8 Max(const Vec3x8& v1, const Vec3x8& v2) {
+    return Vec3x8(_mm256_max_ps(v1.x, v2.x), _mm256_max_ps(v1.y, v2.y), _mm256_max_ps(v1.z, v2.z));
+}
+
+FORCE_INLINE Vec3x8 Select(const Vec3x8& mask, const Vec3x8& a, const Vec3x8& b) {
+    return Vec3x8(_mm256_blendv_ps(b.x, a.x, mask.x), _mm256_blendv_ps(b.y, a.y, mask.y), _mm256_blendv_ps(b.z, a.z, mask.z));
+}
+#endif
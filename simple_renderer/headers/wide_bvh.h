@@ -0,0 +1,122 @@
+#pragma once
+
+#include "common.h"
+#include "simd.h"
+
+// Node of a collapsed 4- or 8-wide triangle BVH. The bounds of all children
+// are stored SoA (one row per axis) so a single SIMD slab test checks every
+// child at once. Leaf children are stored inline as a range of faces.
+template <int N>
+struct WideBVHNode {
+    float bmin[3][N]; // minimum of every child box, per axis
+    float bmax[3][N]; // maximum of every child box, per axis
+    uint32_t child[N]; // interior child: index of its node, leaf child: first face in Surface::indices
+    uint16_t Num_Of_Triangles[N]; // 0 for interior children and empty slots
+    uint16_t pad[N];
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 128, "WideBVHNode<4> should be 128 bytes");
+static_assert(sizeof(WideBVHNode<8>) == 256, "WideBVHNode<8> should be 256 bytes");
+
+// Node of a quantized 4- or 8-wide triangle BVH, about a third of the size of
+// WideBVHNode. Child boxes are stored as 8-bit steps from the minimum corner of
+// the node box, rounded outwards, with steps of a power of two per axis.
+// Interior children are stored consecutively from childBase and the faces of
+// the leaf children consecutively from faceBase, both in slot order.
+template <int N>
+struct QuantizedBVHNode {
+    float origin[3]; // minimum corner of the node box
+    int8_t exponent[3]; // one step along each axis is 2^exponent
+    uint8_t interior; // bit k is set if child k is an interior node
+    uint8_t qmin[3][N]; // minimum of every child box in steps from origin, 255 for empty slots
+    uint8_t qmax[3][N]; // maximum of every child box in steps from origin, 0 for empty slots
+    uint32_t childBase; // node index of the first interior child
+    uint32_t faceBase; // first face of the first leaf child in Surface::indices
+    uint8_t Num_Of_Triangles[N]; // 0 for interior children and empty slots
+};
+
+static_assert(sizeof(QuantizedBVHNode<4>) == 52, "QuantizedBVHNode<4> should be 52 bytes");
+static_assert(sizeof(QuantizedBVHNode<8>) == 80, "QuantizedBVHNode<8> should be 80 bytes");
+
+// Node index (interior children) or first face (leaves) and triangle count of every child
+template <int N>
+inline void wideChildren(const WideBVHNode<N>& node, uint32_t child[N], uint32_t count[N])
+{
+    for (int k = 0; k < N; ++k)
+    {
+        child[k] = node.child[k];
+        count[k] = node.Num_Of_Triangles[k];
+    }
+}
+
+template <int N>
+inline void wideChildren(const QuantizedBVHNode<N>& node, uint32_t child[N], uint32_t count[N])
+{
+    uint32_t interior = node.childBase, face = node.faceBase;
+    for (int k = 0; k < N; ++k)
+    {
+        count[k] = node.Num_Of_Triangles[k];
+        child[k] = (node.interior >> k) & 1 ? interior++ : face;
+        face += count[k];
+    }
+}
+
+// Steps of 2^exponent from origin in float, as decoded by the slab test
+FORCE_INLINE float dequantize(float origin, uint8_t q, float step)
+{
+    return origin + float(q) * step;
+}
+
+// 2^exponent for exponents of normal floats, built from its bits rather than with ldexp
+FORCE_INLINE float quantizationStep(int exponent)
+{
+    uint32_t bits = uint32_t(exponent + 127) << 23;
+    float step;
+    memcpy(&step, &bits, 4);
+    return step;
+}
+
+struct BVHNode;
+
+// Ray in the single precision form used by the wide slab tests
+struct WideBVHRay {
+    float org[3];
+    float invDir[3];
+    float pad[3]; // per-axis widening of the slabs that covers rounding the origin to float
+
+    WideBVHRay(const Ray& ray);
+};
+
+// Collapse a binary BVH into an N-wide one by repeatedly opening the largest
+// interior child until every node has N children (or only leaves are left)
+template <int N>
+void collapseBVH(const std::vector<BVHNode>& binary, std::vector<WideBVHNode<N>>& wide);
+
+// Quantize the collapsed N-wide form of a binary BVH. Leaves are moved within
+// indices so that the leaf children of every node are consecutive, and the
+// offsets of the binary leaves are updated to match.
+template <int N>
+void quantizeBVH(std::vector<BVHNode>& binary, std::vector<Vector3i>& indices, std::vector<QuantizedBVHNode<N>>& quantized);
+
+// Slab test of a ray against all children of a node. Returns a bit mask of the
+// children entered in [0, tMax] and stores the entry distance of every child.
+// The test is conservative: float rounding can add hits but never lose one.
+// The kernel is SSE for 4-wide nodes and AVX (or two SSE halves) for 8-wide nodes,
+// depending on the kernels selected in simd.h.
+inline int slabTestWide(const WideBVHNode<4>& node, const WideBVHRay& ray, float tMax, float tEntry[4])
+{
+    return simdKernels.slabTestWide4(node, ray, tMax, tEntry);
+}
+inline int slabTestWide(const WideBVHNode<8>& node, const WideBVHRay& ray, float tMax, float tEntry[8])
+{
+    return simdKernels.slabTestWide8(node, ray, tMax, tEntry);
+}
+// The same for quantized nodes, whose child boxes are decoded first. Empty slots are never entered.
+inline int slabTestWide(const QuantizedBVHNode<4>& node, const WideBVHRay& ray, float tMax, float tEntry[4])
+{
+    return simdKernels.slabTestQuantized4(node, ray, tMax, tEntry);
+}
+inline int slabTestWide(const QuantizedBVHNode<8>& node, const WideBVHRay& ray, float tMax, float tEntry[8])
+{
+    return simdKernels.slabTestQuantized8(node, ray, tMax, tEntry);
+}
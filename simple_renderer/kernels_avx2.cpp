@@ -0,0 +1,4 @@
+// Intersection kernels for CPUs with AVX2. CMakeLists.txt compiles this file with -mavx2 (/arch:AVX2).
+#define SIMD_NAMESPACE simd_avx2
+#define SIMD_LEVEL SIMD_AVX2
+#include "simd_kernels.h"
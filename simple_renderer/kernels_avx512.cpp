@@ -0,0 +1,6 @@
+// Intersection kernels for CPUs with AVX-512F. CMakeLists.txt compiles this file with the AVX2
+// flags, the 16-ray packet test is the one function built for AVX-512 (see simd_kernels.h).
+#define SIMD_NAMESPACE simd_avx512
+#define SIMD_LEVEL SIMD_AVX512
+#define SIMD_AVX512_PACKETS
+#include "simd_kernels.h"
@@ -0,0 +1,4 @@
+// Intersection kernels for every x86-64 CPU. CMakeLists.txt compiles this file with the default flags.
+#define SIMD_NAMESPACE simd_sse2
+#define SIMD_LEVEL SIMD_SSE2
+#include "simd_kernels.h"
@@ -0,0 +1,5 @@
+// Intersection kernels for CPUs with SSE4.1. CMakeLists.txt compiles this file with -msse4.1;
+// MSVC has no SSE4 switch and builds the SSE2 code here.
+#define SIMD_NAMESPACE simd_sse4
+#define SIMD_LEVEL SIMD_SSE4
+#include "simd_kernels.h"
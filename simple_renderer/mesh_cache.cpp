@@ -0,0 +1,489 @@
+#include "mesh_cache.h"
+
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file, mapped into memory where mmap is available
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string &path)
+    {
+#ifdef _WIN32
+        std::ifstream stream(path.c_str(), std::ios::binary | std::ios::ate);
+        if (!stream)
+            return false;
+        this->buffer.resize(size_t(stream.tellg()));
+        stream.seekg(0);
+        stream.read(this->buffer.data(), this->buffer.size());
+        this->data = this->buffer.data();
+        this->size = this->buffer.size();
+        return bool(stream);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        this->data = static_cast<const char *>(mapped);
+        this->size = st.st_size;
+        return true;
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (this->data != nullptr)
+            munmap(const_cast<char *>(this->data), this->size);
+#endif
+    }
+
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+// FNV-1a over 8-byte words, then over the remaining bytes
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash)
+{
+    const uint64_t prime = 1099511628211ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i)
+    {
+        hash = (hash ^ uint8_t(data[i])) * prime;
+    }
+    return hash;
+}
+
+uint64_t hashObj(const std::string &pathToObj)
+{
+    MappedFile obj;
+    if (!obj.open(pathToObj))
+    {
+        return 0;
+    }
+    uint64_t hash = hashBytes(obj.data, obj.size);
+
+    // materials come from the MTL files named on "mtllib" lines
+    std::string objDirectory;
+    const size_t last_slash_idx = pathToObj.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        objDirectory = pathToObj.substr(0, last_slash_idx) + "/";
+    }
+    const char *end = obj.data + obj.size;
+    const char keyword[] = "mtllib";
+    for (const char *line = obj.data; line < end;)
+    {
+        const char *lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+        lineEnd = lineEnd == nullptr ? end : lineEnd;
+        if (size_t(lineEnd - line) > sizeof(keyword) && memcmp(line, keyword, sizeof(keyword) - 1) == 0)
+        {
+            std::istringstream names(std::string(line + sizeof(keyword) - 1, lineEnd));
+            std::string name;
+            while (names >> name)
+            {
+                MappedFile mtl;
+                hash = mtl.open(objDirectory + name) ? hashBytes(mtl.data, mtl.size, hash) : hashBytes(name.data(), name.size(), hash);
+            }
+        }
+        line = lineEnd + 1;
+    }
+    return hash;
+}
+
+uint64_t hashBVHSettings(const BVHSettings &settings)
+{
+    int ints[7] = {int(settings.builder), settings.bins, settings.maxLeafSize, settings.width, settings.mortonBits, settings.treeletSize,
+                   int(settings.quantized)};
+    float floats[3] = {settings.leafCost, settings.duplicationBudget, settings.spatialAlpha};
+    return hashBytes(reinterpret_cast<const char *>(floats), sizeof(floats), hashBytes(reinterpret_cast<const char *>(ints), sizeof(ints)));
+}
+
+static std::string meshCachePath(const std::string &pathToObj)
+{
+    return pathToObj + ".cache";
+}
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout[4]; // sizes of the stored structs, the cache is not portable across layouts
+    uint64_t objHash;
+    uint64_t settingsHash;
+    uint64_t numSurfaces;
+};
+
+// Counts and scalar fields of one surface, followed in the file by its texture
+// names and arrays in the order they are written in saveMeshCache
+struct MeshCacheSurface {
+    uint64_t numVertices;
+    uint64_t numIndices;
+    uint64_t numNodes, numNodes4, numNodes8, numQuantized4, numQuantized8;
+    uint64_t numRecords; // length of each triangle record array, including padding
+    uint64_t duplicates;
+    uint64_t diffuseTextureName, alphaTextureName; // name lengths
+    double sahCost;
+    Vector3f diffuse, origin;
+    float alpha;
+    uint32_t pad;
+};
+
+static void fillHeader(MeshCacheHeader &header, uint64_t objHash, const BVHSettings &settings, uint64_t numSurfaces)
+{
+    memcpy(header.magic, "SRMESH\0\0", 8);
+    header.version = MESH_CACHE_VERSION;
+    header.layout[0] = sizeof(Vector3f);
+    header.layout[1] = sizeof(BVHNode);
+    header.layout[2] = sizeof(MeshCacheSurface);
+    header.layout[3] = sizeof(WideBVHNode<8>);
+    header.objHash = objHash;
+    header.settingsHash = hashBVHSettings(settings);
+    header.numSurfaces = numSurfaces;
+}
+
+// Bounds checked reads from the mapped cache file
+struct CacheReader {
+    const char *data;
+    size_t size;
+    size_t pos = 0;
+
+    template <typename T>
+    bool read(T &value)
+    {
+        if (this->size - this->pos < sizeof(T))
+            return false;
+        memcpy(&value, this->data + this->pos, sizeof(T));
+        this->pos += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    bool readArray(std::vector<T> &values, uint64_t count)
+    {
+        if (count > (this->size - this->pos) / sizeof(T))
+            return false;
+        values.resize(count);
+        if (count > 0)
+            memcpy(values.data(), this->data + this->pos, count * sizeof(T));
+        this->pos += count * sizeof(T);
+        return true;
+    }
+
+    bool readString(std::string &value, uint64_t length)
+    {
+        if (length > this->size - this->pos)
+            return false;
+        value.assign(this->data + this->pos, length);
+        this->pos += length;
+        return true;
+    }
+};
+
+// Whether an empty slot, which collapseBVH fills with a box no ray can enter
+template <int N>
+static bool emptySlot(const WideBVHNode<N> &node, int k)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        if (node.bmin[a][k] != INFINITY || node.bmax[a][k] != -INFINITY)
+            return false;
+    }
+    return node.child[k] == 0;
+}
+
+// The cached trees are trusted by the traversals, so a damaged file must not reach them. Leaves
+// have to lie in the faces, and children come after their parent in every layout, which rules
+// out cycles; depth counts the nodes above each one, which the fixed traversal stacks bound.
+static bool visitChild(std::vector<int> &depth, size_t parent, uint64_t child)
+{
+    if (child <= parent || child >= depth.size() || depth[parent] + 1 >= BVH_STACK_SIZE)
+        return false;
+    depth[child] = std::max(depth[child], depth[parent] + 1);
+    return true;
+}
+
+static bool checkNodes(const std::vector<BVHNode> &nodes, uint64_t numIndices)
+{
+    std::vector<int> depth(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const BVHNode &node = nodes[i];
+        if (node.isLeaf() ? uint64_t(node.offset) + node.Num_Of_Triangles > numIndices
+                          : node.offset <= i + 1 || !visitChild(depth, i, i + 1) || !visitChild(depth, i, node.offset))
+            return false;
+    }
+    return true;
+}
+
+template <int N>
+static bool checkNodes(const std::vector<WideBVHNode<N>> &nodes, uint64_t numIndices)
+{
+    std::vector<int> depth(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const WideBVHNode<N> &node = nodes[i];
+        for (int k = 0; k < N; ++k)
+        {
+            // the slab test does not skip empty slots, only their boxes keep it from entering them
+            if (node.Num_Of_Triangles[k] > 0 ? uint64_t(node.child[k]) + node.Num_Of_Triangles[k] > numIndices
+                                             : !emptySlot(node, k) && !visitChild(depth, i, node.child[k]))
+                return false;
+        }
+    }
+    return true;
+}
+
+template <int N>
+static bool checkNodes(const std::vector<QuantizedBVHNode<N>> &nodes, uint64_t numIndices)
+{
+    std::vector<int> depth(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const QuantizedBVHNode<N> &node = nodes[i];
+        uint64_t child = node.childBase, face = node.faceBase;
+        for (int k = 0; k < N; ++k)
+        {
+            if ((node.interior >> k) & 1)
+            {
+                if (node.Num_Of_Triangles[k] != 0 || !visitChild(depth, i, child++))
+                    return false;
+            }
+            face += node.Num_Of_Triangles[k];
+        }
+        if (face > numIndices)
+            return false;
+    }
+    return true;
+}
+
+bool loadMeshCache(const std::string &pathToObj, uint64_t objHash, const BVHSettings &settings,
+                   bool isLight, uint32_t shapeIdx, std::vector<Surface> &surfaces)
+{
+    auto loadStart = std::chrono::high_resolution_clock::now();
+
+    MappedFile file;
+    if (!file.open(meshCachePath(pathToObj)))
+    {
+        return false;
+    }
+
+    CacheReader reader{file.data, file.size};
+    MeshCacheHeader header, expected;
+    fillHeader(expected, objHash, settings, 0);
+    if (!reader.read(header) || memcmp(header.magic, expected.magic, 8) != 0 || header.version != expected.version ||
+        memcmp(header.layout, expected.layout, sizeof(header.layout)) != 0 ||
+        header.objHash != objHash || header.settingsHash != expected.settingsHash)
+    {
+        return false;
+    }
+
+    std::string objDirectory;
+    const size_t last_slash_idx = pathToObj.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        objDirectory = pathToObj.substr(0, last_slash_idx);
+    }
+
+    if (header.numSurfaces > file.size / sizeof(MeshCacheSurface))
+    {
+        return false;
+    }
+    std::vector<Surface> loaded(header.numSurfaces);
+    for (Surface &surf : loaded)
+    {
+        MeshCacheSurface record;
+        if (!reader.read(record))
+        {
+            return false;
+        }
+        surf.isLight = isLight;
+        surf.shapeIdx = shapeIdx++;
+        surf.diffuse = record.diffuse;
+        surf.alpha = record.alpha;
+
+        TriangleRecords &tris = surf.triangles;
+        tris.origin = record.origin;
+        bool ok = reader.readString(surf.diffuseTextureName, record.diffuseTextureName) &&
+                  reader.readString(surf.alphaTextureName, record.alphaTextureName) &&
+                  reader.readArray(surf.vertices, record.numVertices) &&
+                  reader.readArray(surf.normals, record.numVertices) &&
+                  reader.readArray(surf.uvs, record.numVertices) &&
+                  reader.readArray(surf.indices, record.numIndices) &&
+                  reader.readArray(surf.bvh.nodes, record.numNodes) &&
+                  reader.readArray(surf.bvh.nodes4, record.numNodes4) &&
+                  reader.readArray(surf.bvh.nodes8, record.numNodes8) &&
+                  reader.readArray(surf.bvh.quantized4, record.numQuantized4) &&
+                  reader.readArray(surf.bvh.quantized8, record.numQuantized8);
+        for (int a = 0; a < 3 && ok; ++a)
+        {
+            ok = reader.readArray(tris.v0[a], record.numRecords) && reader.readArray(tris.e1[a], record.numRecords) &&
+                 reader.readArray(tris.e2[a], record.numRecords);
+        }
+        ok = ok && reader.readArray(tris.normals, record.numIndices);
+        if (!ok)
+        {
+            return false;
+        }
+
+        // every face must lie in the vertex arrays and every leaf in the faces
+        for (const Vector3i &face : surf.indices)
+        {
+            if (uint64_t(face.x) >= record.numVertices || uint64_t(face.y) >= record.numVertices || uint64_t(face.z) >= record.numVertices)
+                return false;
+        }
+        if (!checkNodes(surf.bvh.nodes, record.numIndices) || !checkNodes(surf.bvh.nodes4, record.numIndices) ||
+            !checkNodes(surf.bvh.nodes8, record.numIndices) || !checkNodes(surf.bvh.quantized4, record.numIndices) ||
+            !checkNodes(surf.bvh.quantized8, record.numIndices))
+        {
+            return false;
+        }
+
+        // the wide layout the settings select has to be there, and the records padded for four-wide loads
+        size_t wideNodes = settings.width == 4 ? (settings.quantized ? record.numQuantized4 : record.numNodes4)
+                           : settings.width == 8 ? (settings.quantized ? record.numQuantized8 : record.numNodes8)
+                                                 : record.numNodes;
+        if ((record.numNodes > 0 && wideNodes == 0) || record.numRecords != record.numIndices + TRIANGLE_PADDING)
+        {
+            return false;
+        }
+
+        surf.aabb[0] = Vector3f(1e30, 1e30, 1e30);
+        surf.aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+        for (const Vector3f &vertex : surf.vertices)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                surf.aabb[0][i] = std::min(surf.aabb[0][i], vertex[i]);
+                surf.aabb[1][i] = std::max(surf.aabb[1][i], vertex[i]);
+            }
+        }
+
+        surf.bvh.settings = settings;
+        surf.bvh.width = settings.width;
+        surf.bvh.quantized = settings.quantized;
+        surf.bvh.sahCost = surf.bvh.refitSahCost = record.sahCost;
+        surf.bvh.duplicates = record.duplicates;
+        surf.bvh.fromCache = true;
+    }
+
+    // textures are not cached, they are loaded as for a parsed OBJ
+    for (Surface &surf : loaded)
+    {
+        if (surf.diffuseTextureName != "")
+            surf.diffuseTexture = Texture(objDirectory + "/" + surf.diffuseTextureName);
+        if (surf.alphaTextureName != "")
+            surf.alphaTexture = Texture(objDirectory + "/" + surf.alphaTextureName);
+    }
+
+    auto loadEnd = std::chrono::high_resolution_clock::now();
+    double loadMs = std::chrono::duration<double, std::milli>(loadEnd - loadStart).count();
+    for (Surface &surf : loaded)
+    {
+        surf.bvh.buildMs = loadMs / loaded.size();
+    }
+
+    surfaces.insert(surfaces.end(), std::make_move_iterator(loaded.begin()), std::make_move_iterator(loaded.end()));
+    return true;
+}
+
+template <typename T>
+static void writeArray(std::ofstream &stream, const std::vector<T> &values)
+{
+    stream.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+void saveMeshCache(const std::string &pathToObj, uint64_t objHash, const BVHSettings &settings,
+                   const Surface *surfaces, size_t numSurfaces)
+{
+    // write a temporary file of this process and rename it, so a concurrent run never maps a partial cache
+    std::string path = meshCachePath(pathToObj);
+#ifdef _WIN32
+    std::string tmpPath = path + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    std::ofstream stream(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+
+    MeshCacheHeader header;
+    fillHeader(header, objHash, settings, numSurfaces);
+    stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    for (size_t s = 0; s < numSurfaces; ++s)
+    {
+        const Surface &surf = surfaces[s];
+        const TriangleRecords &tris = surf.triangles;
+
+        MeshCacheSurface record = {};
+        record.numVertices = surf.vertices.size();
+        record.numIndices = surf.indices.size();
+        record.numNodes = surf.bvh.nodes.size();
+        record.numNodes4 = surf.bvh.nodes4.size();
+        record.numNodes8 = surf.bvh.nodes8.size();
+        record.numQuantized4 = surf.bvh.quantized4.size();
+        record.numQuantized8 = surf.bvh.quantized8.size();
+        record.numRecords = tris.v0[0].size();
+        record.duplicates = surf.bvh.duplicates;
+        record.diffuseTextureName = surf.diffuseTextureName.size();
+        record.alphaTextureName = surf.alphaTextureName.size();
+        record.sahCost = surf.bvh.sahCost;
+        record.diffuse = surf.diffuse;
+        record.origin = tris.origin;
+        record.alpha = surf.alpha;
+        stream.write(reinterpret_cast<const char *>(&record), sizeof(record));
+
+        stream << surf.diffuseTextureName << surf.alphaTextureName;
+        writeArray(stream, surf.vertices);
+        writeArray(stream, surf.normals);
+        writeArray(stream, surf.uvs);
+        writeArray(stream, surf.indices);
+        writeArray(stream, surf.bvh.nodes);
+        writeArray(stream, surf.bvh.nodes4);
+        writeArray(stream, surf.bvh.nodes8);
+        writeArray(stream, surf.bvh.quantized4);
+        writeArray(stream, surf.bvh.quantized8);
+        for (int a = 0; a < 3; ++a)
+        {
+            writeArray(stream, tris.v0[a]);
+            writeArray(stream, tris.e1[a]);
+            writeArray(stream, tris.e2[a]);
+        }
+        writeArray(stream, tris.normals);
+    }
+
+    stream.close();
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (!stream || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Could not write the mesh cache " << path << "." << std::endl;
+        std::remove(tmpPath.c_str());
+    }
+}
@@ -0,0 +1,38 @@
+#include "ray_packet.h"
+
+template <int N>
+RayPacket<N>::RayPacket(const Ray rays[N])
+{
+    for (int k = 0; k < N; ++k)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            this->org[a][k] = rays[k].o[a];
+            this->invDir[a][k] = rays[k].invDir[a];
+            this->pad[a][k] = floatUlp(this->org[a][k]) * std::abs(this->invDir[a][k]);
+        }
+        this->t[k] = rays[k].t;
+    }
+}
+
+template <int N>
+int slabTestPacket(const Vector3f aabb[2], const RayPacket<N> &packet, int active, float tEntry[N])
+{
+    float bmin[3], bmax[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        bmin[a] = float(aabb[0][a]);
+        bmax[a] = float(aabb[1][a]);
+        bmin[a] = bmin[a] > aabb[0][a] ? std::nextafter(bmin[a], -INFINITY) : bmin[a];
+        bmax[a] = bmax[a] < aabb[1][a] ? std::nextafter(bmax[a], INFINITY) : bmax[a];
+    }
+    return slabTestPacket<N>(bmin, bmax, packet, active, tEntry);
+}
+
+template struct RayPacket<4>;
+template struct RayPacket<8>;
+template struct RayPacket<16>;
+
+template int slabTestPacket<4>(const Vector3f aabb[2], const RayPacket<4> &packet, int active, float tEntry[4]);
+template int slabTestPacket<8>(const Vector3f aabb[2], const RayPacket<8> &packet, int active, float tEntry[8]);
+template int slabTestPacket<16>(const Vector3f aabb[2], const RayPacket<16> &packet, int active, float tEntry[16]);
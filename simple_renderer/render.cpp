@@ -1,64 +1,344 @@
 #include "render.h"
 
-int intersection_type;
-Integrator::Integrator(Scene &scene)
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+thread_local RayStats ray_stats;
+
+// Point d of the Morton (Z-order) curve: x from the even bits of d, y from the odd ones
+static Vector2i mortonPoint(int d)
 {
-    this->scene = scene;
-    this->outputImage.allocate(TextureType::UNSIGNED_INTEGER_ALPHA, this->scene.imageResolution);
+    Vector2i p(0, 0);
+    for (int bit = 0; (d >> (2 * bit)) != 0; bit++) {
+        p.x |= ((d >> (2 * bit)) & 1) << bit;
+        p.y |= ((d >> (2 * bit + 1)) & 1) << bit;
+    }
+    return p;
 }
 
-long long Integrator::render()
+// Point d of the Hilbert curve through an n x n grid, n a power of two
+static Vector2i hilbertPoint(int n, int d)
 {
-    auto startTime = std::chrono::high_resolution_clock::now();
-    for (int x = 0; x < this->scene.imageResolution.x; x++) {
-        for (int y = 0; y < this->scene.imageResolution.y; y++) {
-            Ray cameraRay = this->scene.camera.generateRay(x, y);
-            // std::cout << "cordinate :" << x << y  << "Camera ray: " << cameraRay.d.x << " " << cameraRay.d.y << " " << cameraRay.d.z << std::endl;
-            Interaction si = this->scene.rayIntersect(cameraRay);
-
-            if (si.didIntersect)
-                this->outputImage.writePixelColor(0.5f * (si.n + Vector3f(1.f, 1.f, 1.f)), x, y);
+    Vector2i p(0, 0);
+    for (int s = 1; s < n; s *= 2, d /= 4) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            // rotate the quadrant
+            if (rx == 1) {
+                p.x = s - 1 - p.x;
+                p.y = s - 1 - p.y;
+            }
+            std::swap(p.x, p.y);
+        }
+        p.x += s * rx;
+        p.y += s * ry;
+    }
+    return p;
+}
+
+// Cells of a width x height grid in the given order. The curves run over the enclosing
+// power of two square and skip the cells outside the grid.
+static std::vector<Vector2i> gridOrder(PixelOrder order, int width, int height)
+{
+    std::vector<Vector2i> cells;
+    if (order == PIXEL_ORDER_COLUMNS || order == PIXEL_ORDER_ROWS) {
+        for (int i = 0; i < width * height; i++) {
+            if (order == PIXEL_ORDER_COLUMNS)
+                cells.push_back(Vector2i(i / height, i % height));
             else
-                this->outputImage.writePixelColor(Vector3f(0.0f, 0.0f, 0.0f), x, y);
+                cells.push_back(Vector2i(i % width, i / width));
         }
+        return cells;
+    }
+
+    int n = 1;
+    while (n < std::max(width, height))
+        n *= 2;
+    for (int d = 0; d < n * n; d++) {
+        Vector2i p = order == PIXEL_ORDER_MORTON ? mortonPoint(d) : hilbertPoint(n, d);
+        if (p.x < width && p.y < height)
+            cells.push_back(p);
+    }
+    return cells;
+}
+
+Integrator::Integrator(Scene &scene) : scene(scene)
+{
+    const RenderSettings &settings = this->scene.renderSettings;
+    this->outputImage.allocate(TextureType::UNSIGNED_INTEGER_ALPHA, this->scene.imageResolution,
+                               settings.tiledFramebuffer ? settings.tileSize : 0);
+
+    this->numThreads = settings.threads;
+    if (this->numThreads == 0)
+        this->numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    int tileSize = settings.tileSize;
+    this->numTiles = Vector2i((this->scene.imageResolution.x + tileSize - 1) / tileSize,
+                              (this->scene.imageResolution.y + tileSize - 1) / tileSize);
+
+    // packets walk the tile in blocks of 2x2, 4x2 or 4x4 pixels, see renderPackets
+    int blockWidth = settings.packetSize == 1 ? 1 : (settings.packetSize == 4 ? 2 : 4);
+    int blockHeight = settings.packetSize / blockWidth;
+    this->tileOrder = gridOrder(settings.pixelOrder, (tileSize + blockWidth - 1) / blockWidth,
+                                (tileSize + blockHeight - 1) / blockHeight);
+}
+
+// Tiles owned by one worker. The owner takes tiles from the front, other
+// workers steal half of the remaining tiles from the back.
+struct TileDeque {
+    std::mutex mutex;
+    std::deque<int> tiles;
+
+    bool pop(int &tile)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->tiles.empty())
+            return false;
+        tile = this->tiles.front();
+        this->tiles.pop_front();
+        return true;
+    }
+
+    void push(const std::vector<int> &newTiles)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->tiles.insert(this->tiles.end(), newTiles.begin(), newTiles.end());
+    }
+
+    bool steal(std::vector<int> &loot)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        size_t count = (this->tiles.size() + 1) / 2;
+        loot.assign(this->tiles.end() - count, this->tiles.end());
+        this->tiles.erase(this->tiles.end() - count, this->tiles.end());
+        return count > 0;
+    }
+};
+
+long long Integrator::render()
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // every pixel is written by exactly one tile, so the image does not depend on
+    // the thread count or on which worker renders a tile
+    int totalTiles = this->numTiles.x * this->numTiles.y;
+    bool stealing = this->scene.renderSettings.scheduler == SCHEDULER_STEALING;
+    std::atomic<int> nextTile(0);
+    std::mutex statsMutex;
+    this->stats = RayStats();
+    this->workerStats.assign(this->numThreads, WorkerStats());
+
+    // with work stealing every worker starts with a contiguous block of tiles
+    std::vector<TileDeque> deques(stealing ? this->numThreads : 0);
+    for (int i = 0; i < (int)deques.size(); i++) {
+        for (int tile = totalTiles * i / this->numThreads; tile < totalTiles * (i + 1) / this->numThreads; tile++)
+            deques[i].tiles.push_back(tile);
     }
+
+    auto fetchTile = [&](int id, int &tile) -> bool {
+        if (!stealing) {
+            tile = nextTile++;
+            return tile < totalTiles;
+        }
+        if (deques[id].pop(tile))
+            return true;
+
+        // own deque is empty: steal from the other workers in turn
+        std::vector<int> loot;
+        for (int k = 1; k < this->numThreads; k++) {
+            if (deques[(id + k) % this->numThreads].steal(loot)) {
+                this->workerStats[id].stolen += loot.size();
+                tile = loot.front();
+                loot.erase(loot.begin());
+                deques[id].push(loot);
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto worker = [&](int id) {
+        ray_stats = RayStats();
+        WorkerStats &workerStats = this->workerStats[id];
+
+        int tile;
+        while (fetchTile(id, tile)) {
+            auto tileStart = std::chrono::high_resolution_clock::now();
+            this->scene.accelerator->renderTile(*this, tile);
+            auto tileEnd = std::chrono::high_resolution_clock::now();
+
+            workerStats.busyMs += std::chrono::duration<double, std::milli>(tileEnd - tileStart).count();
+            workerStats.tiles++;
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        this->stats += ray_stats;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < this->numThreads; i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto &thread : threads)
+        thread.join();
+
     auto finishTime = std::chrono::high_resolution_clock::now();
 
+    double totalMs = std::chrono::duration<double, std::milli>(finishTime - startTime).count();
+    for (auto &workerStats : this->workerStats)
+        workerStats.idleMs = totalMs - workerStats.busyMs;
+
     return std::chrono::duration_cast<std::chrono::microseconds>(finishTime - startTime).count();
 }
 
+// Options of the form --<section>.<key>=<value> override the scene file,
+// e.g. --bvh.builder=sah becomes {"bvh": {"builder": "sah"}}
+nlohmann::json parseOptions(int first, int argc, char **argv)
+{
+    nlohmann::json options = nlohmann::json::object();
+    for (int i = first; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+            std::cerr << "Ignoring malformed option " << arg << " (expected --<section>.<key>=<value>)\n";
+            continue;
+        }
+
+        std::string path = "/" + arg.substr(2, eq - 2);
+        std::replace(path.begin(), path.end(), '.', '/');
+        std::string value = arg.substr(eq + 1);
+
+        // numbers and booleans are stored as such, anything else as a string
+        nlohmann::json parsed = nlohmann::json::parse(value, nullptr, false);
+        options[nlohmann::json::json_pointer(path)] = parsed.is_discarded() ? nlohmann::json(value) : parsed;
+    }
+    return options;
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 4) {
-        std::cerr << "Usage: ./render <scene_config> <out_path> <intersection_variant>\n";
+    if (argc < 3) {
+        std::cerr << "Usage: ./render <scene_config> <out_path> [<accelerator>] [--<section>.<key>=<value> ...]\n";
+        std::cerr << "Accelerators:";
+        for (auto &registered : acceleratorRegistry())
+            std::cerr << " " << registered.first;
+        std::cerr << " (or the old intersection variants 0-3)\n";
         return 1;
     }
-    Scene scene(argv[1]);
 
-    intersection_type = std::stoi(argv[3]);
-    switch (intersection_type)
-    {
-    case 0:
-        printf("Intersection type: NAIVE\n");
-        break;
-    case 1:
-        printf("Intersection type: AABB\n");
-        break;
-    case 2:
-        printf("Intersection type: BVH\n");
-        break;    
-    case 3:
-        printf("Intersection type: two level BVH\n");
-        break;
-    default:
-        break;
+    // the accelerator can be given by name or by the number of the old intersection variants
+    int firstOption = 3;
+    nlohmann::json overrides = nlohmann::json::object();
+    if (argc > 3 && std::string(argv[3]).rfind("--", 0) != 0) {
+        const char *variants[] = {"naive", "aabb", "bvh", "two_level_bvh"};
+        std::string accelerator = argv[3];
+        if (accelerator.size() == 1 && accelerator[0] >= '0' && accelerator[0] <= '3')
+            accelerator = variants[accelerator[0] - '0'];
+        overrides["accelerator"] = accelerator;
+        firstOption = 4;
     }
+    overrides.merge_patch(parseOptions(firstOption, argc, argv));
+    Scene scene(argv[1], overrides);
 
+    printf("Accelerator: %s, built in %.3f ms (%zu nodes, %.2f KB)\n", scene.accelerator->name.c_str(),
+        scene.accelerator->stats.buildMs, scene.accelerator->stats.nodes, scene.accelerator->stats.bytes / 1024.0);
+    printf("BVH builder: %s, %d-wide", BVHBuilderName(scene.bvhSettings.builder).c_str(), scene.bvhSettings.width);
+    if (scene.bvhSettings.builder == BVH_SAH)
+        printf(" (bins: %d, leaf cost: %.2f)", scene.bvhSettings.bins, scene.bvhSettings.leafCost);
+    if (scene.bvhSettings.builder == BVH_LBVH)
+        printf(" (%d-bit Morton codes, treelet size: %d)", scene.bvhSettings.mortonBits, scene.bvhSettings.treeletSize);
+    if (scene.bvhSettings.builder == BVH_SBVH)
+        printf(" (bins: %d, leaf cost: %.2f, duplication budget: %.2f, spatial alpha: %g)", scene.bvhSettings.bins,
+            scene.bvhSettings.leafCost, scene.bvhSettings.duplicationBudget, scene.bvhSettings.spatialAlpha);
+    int buildThreads = scene.bvhSettings.threads > 0 ? scene.bvhSettings.threads : std::max(1u, std::thread::hardware_concurrency());
+    printf(", %d build threads\n", buildThreads);
+
+    // surfaces with their own geometry and the meshes of instances, each built once
+    std::vector<const Surface *> geometry;
+    size_t instances = 0, instancedTriangles = 0;
+    for (auto &surface : scene.surfaces) {
+        if (surface.mesh != NULL) {
+            instances++;
+            instancedTriangles += surface.mesh->indices.size() - surface.mesh->bvh.duplicates;
+        }
+        else
+            geometry.push_back(&surface);
+    }
+    for (auto &mesh : scene.meshes)
+        geometry.push_back(&mesh);
+
+    // surfaces can override the builder, so report every builder that was used
+    for (int builder = 0; builder < NUM_BVH_BUILDERS; builder++) {
+        int surfaces = 0, cached = 0;
+        size_t triangles = 0, duplicates = 0;
+        double buildMs = 0, sahCost = 0;
+        for (const Surface *surface : geometry) {
+            if (surface->bvh.settings.builder != builder)
+                continue;
+            surfaces++;
+            cached += surface->bvh.fromCache;
+            triangles += surface->indices.size() - surface->bvh.duplicates;
+            duplicates += surface->bvh.duplicates;
+            buildMs += surface->bvh.buildMs;
+            sahCost += surface->bvh.sahCost * surface->indices.size();
+        }
+        if (surfaces == 0)
+            continue;
+        printf("  %s: %d surfaces, %zu triangles", BVHBuilderName(BVHBuilder(builder)).c_str(), surfaces, triangles);
+        if (duplicates > 0)
+            printf(" (+%zu references from spatial splits)", duplicates);
+        if (cached == surfaces)
+            printf(", loaded from the mesh cache in %.3f ms", buildMs);
+        else if (cached > 0)
+            printf(", built or loaded (%d from the mesh cache) in %.3f ms", cached, buildMs);
+        else
+            printf(", built in %.3f ms", buildMs);
+        printf(", mean SAH cost %.2f\n", sahCost / (triangles + duplicates));
+    }
+
+    if (instances > 0)
+        printf("Instances: %zu of %zu meshes, %zu triangles instanced\n", instances, scene.meshes.size(), instancedTriangles);
+    if (scene.deduplicate)
+        printf("Deduplication: %zu surfaces became instances of %zu meshes in %.3f ms, saving %.2f MB of geometry and about %.3f ms of BVH builds\n",
+            scene.dedupStats.instances, scene.dedupStats.meshes, scene.dedupStats.ms, scene.dedupStats.bytesSaved / 1048576.0,
+            scene.dedupStats.buildMsSaved);
+
+    // instances only add their Surface and their leaf in the BVH over the surfaces
+    GeometryMemory mem;
+    for (const Surface *surface : geometry)
+        mem += surface->memoryUsage();
+    mem.bytes += instances * sizeof(Surface);
+    if (mem.triangles > 0) {
+        printf("Geometry memory: %.2f MB (%.1f bytes/triangle), was %.2f MB (%.1f bytes/triangle) with per-node triangle copies\n",
+            mem.bytes / 1048576.0, mem.bytes / double(mem.triangles),
+            mem.legacyBytes / 1048576.0, mem.legacyBytes / double(mem.triangles));
+        printf("Traversed BVH nodes: %.2f MB (%.1f bytes/triangle)\n", mem.nodeBytes / 1048576.0, mem.nodeBytes / double(mem.triangles));
+    }
+
+
+    selectSimdKernels(scene.renderSettings.simd);
+    printf("SIMD kernels: %s (%s, the CPU supports up to %s)\n", SimdLevelName(simdKernels.level).c_str(),
+        scene.renderSettings.simd == SIMD_AUTO ? "detected" : "set by render.simd", SimdLevelName(detectSimdLevel()).c_str());
 
     Integrator rayTracer(scene);
+    printf("Render threads: %d, tile size: %d, scheduler: %s, packet size: %d, pixel order: %s, %s framebuffer\n", rayTracer.numThreads,
+        scene.renderSettings.tileSize, scene.renderSettings.scheduler == SCHEDULER_STEALING ? "stealing" : "shared",
+        scene.renderSettings.packetSize, PixelOrderName(scene.renderSettings.pixelOrder).c_str(),
+        scene.renderSettings.tiledFramebuffer ? "tiled" : "row-major");
     auto renderTime = rayTracer.render();
 
     std::cout << "Render Time: " << std::to_string(renderTime / 1000.f) << " ms" << std::endl;
+    printf("Per ray: %.2f node tests, %.2f triangle tests, %.2f Mrays/s\n",
+        rayTracer.stats.nodeTests / double(rayTracer.stats.rays), rayTracer.stats.triangleTests / double(rayTracer.stats.rays),
+        rayTracer.stats.rays / double(renderTime));
+    for (int i = 0; i < rayTracer.numThreads; i++) {
+        const WorkerStats &worker = rayTracer.workerStats[i];
+        printf("Worker %d: %d tiles (%d stolen), busy %.3f ms, idle %.3f ms\n",
+            i, worker.tiles, worker.stolen, worker.busyMs, worker.idleMs);
+    }
     rayTracer.outputImage.save(argv[2]);
 
     return 0;
@@ -1,4 +1,7 @@
 #include "scene.h"
+#include "mesh_cache.h"
+
+#include <tuple>
 
 Scene::Scene(std::string sceneDirectory, std::string sceneJson)
 {
@@ -16,7 +19,7 @@ Scene::Scene(std::string sceneDirectory, std::string sceneJson)
     this->parse(sceneDirectory, sceneConfig);
 }
 
-Scene::Scene(std::string pathToJson)
+Scene::Scene(std::string pathToJson, nlohmann::json overrides)
 {
     std::string sceneDirectory;
 
@@ -43,9 +46,131 @@ Scene::Scene(std::string pathToJson)
         exit(1);
     }
 
+    // command line options take precedence over the scene file
+    sceneConfig.merge_patch(overrides);
+
     this->parse(sceneDirectory, sceneConfig);
 }
 
+RenderSettings parseRenderSettings(nlohmann::json renderConfig)
+{
+    RenderSettings settings;
+
+    settings.threads = renderConfig.value("threads", settings.threads);
+    settings.tileSize = renderConfig.value("tileSize", settings.tileSize);
+
+    std::string scheduler = renderConfig.value("scheduler", std::string("stealing"));
+    if (scheduler == "stealing")
+        settings.scheduler = SCHEDULER_STEALING;
+    else if (scheduler == "shared")
+        settings.scheduler = SCHEDULER_SHARED;
+    else
+    {
+        std::cerr << "Unknown tile scheduler \"" << scheduler << "\" (expected \"stealing\" or \"shared\")." << std::endl;
+        exit(1);
+    }
+
+    settings.packetSize = renderConfig.value("packetSize", settings.packetSize);
+
+    std::string pixelOrder = renderConfig.value("pixelOrder", PixelOrderName(settings.pixelOrder));
+    if (pixelOrder == "columns")
+        settings.pixelOrder = PIXEL_ORDER_COLUMNS;
+    else if (pixelOrder == "rows")
+        settings.pixelOrder = PIXEL_ORDER_ROWS;
+    else if (pixelOrder == "morton")
+        settings.pixelOrder = PIXEL_ORDER_MORTON;
+    else if (pixelOrder == "hilbert")
+        settings.pixelOrder = PIXEL_ORDER_HILBERT;
+    else
+    {
+        std::cerr << "Unknown pixel order \"" << pixelOrder << "\" (expected \"columns\", \"rows\", \"morton\" or \"hilbert\")." << std::endl;
+        exit(1);
+    }
+
+    std::string framebuffer = renderConfig.value("framebuffer", std::string(settings.tiledFramebuffer ? "tiled" : "rows"));
+    if (framebuffer != "tiled" && framebuffer != "rows")
+    {
+        std::cerr << "Unknown framebuffer layout \"" << framebuffer << "\" (expected \"tiled\" or \"rows\")." << std::endl;
+        exit(1);
+    }
+    settings.tiledFramebuffer = framebuffer == "tiled";
+
+    std::string simd = renderConfig.value("simd", SimdLevelName(settings.simd));
+    for (int level = SIMD_AUTO; level < NUM_SIMD_LEVELS; level++)
+    {
+        if (simd == SimdLevelName(SimdLevel(level)))
+            settings.simd = SimdLevel(level);
+    }
+    if (simd != SimdLevelName(settings.simd))
+    {
+        std::cerr << "Unknown SIMD level \"" << simd << "\" (expected \"auto\", \"sse2\", \"sse4\", \"avx2\" or \"avx512\")." << std::endl;
+        exit(1);
+    }
+
+    if (settings.threads < 0 || settings.tileSize < 1 ||
+        (settings.packetSize != 1 && settings.packetSize != 4 && settings.packetSize != 8 && settings.packetSize != 16))
+    {
+        std::cerr << "Render settings out of range (threads >= 0, tileSize >= 1, packetSize 1, 4, 8 or 16)." << std::endl;
+        exit(1);
+    }
+
+    return settings;
+}
+
+std::string PixelOrderName(PixelOrder order)
+{
+    switch (order)
+    {
+    case PIXEL_ORDER_COLUMNS:
+        return "columns";
+    case PIXEL_ORDER_ROWS:
+        return "rows";
+    case PIXEL_ORDER_MORTON:
+        return "morton";
+    case PIXEL_ORDER_HILBERT:
+        return "hilbert";
+    default:
+        return "unknown";
+    }
+}
+
+// A 4x4 matrix, as four rows or as 16 numbers in row-major order. The last row must be 0 0 0 1.
+Transform parseTransform(nlohmann::json transformConfig)
+{
+    Transform transform;
+    if (transformConfig.is_null())
+    {
+        return transform;
+    }
+
+    std::vector<double> values;
+    for (auto &row : transformConfig)
+    {
+        if (row.is_array())
+            values.insert(values.end(), row.begin(), row.end());
+        else
+            values.push_back(row);
+    }
+    if (values.size() != 16 || values[12] != 0 || values[13] != 0 || values[14] != 0 || values[15] != 1)
+    {
+        std::cerr << "Instance transforms should be affine 4x4 matrices (last row 0 0 0 1)." << std::endl;
+        exit(1);
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            transform.m[i][j] = values[4 * i + j];
+        }
+    }
+    if (transform.determinant() == 0)
+    {
+        std::cerr << "Instance transforms should be invertible." << std::endl;
+        exit(1);
+    }
+    return transform;
+}
+
 void Scene::parse(std::string sceneDirectory, nlohmann::json sceneConfig)
 {
     // Output
@@ -78,266 +203,244 @@ void Scene::parse(std::string sceneDirectory, nlohmann::json sceneConfig)
         exit(1);
     }
 
+    // Render settings (optional)
+    if (sceneConfig.contains("render"))
+    {
+        try
+        {
+            this->renderSettings = parseRenderSettings(sceneConfig["render"]);
+        }
+        catch (nlohmann::json::exception e)
+        {
+            std::cerr << "Invalid \"render\" settings in the scene file." << std::endl;
+            exit(1);
+        }
+    }
+
+    // BVH build settings (optional)
+    nlohmann::json bvhConfig = nlohmann::json::object();
+    if (sceneConfig.contains("bvh"))
+    {
+        bvhConfig = sceneConfig["bvh"];
+        try
+        {
+            this->bvhSettings = parseBVHSettings(bvhConfig);
+        }
+        catch (nlohmann::json::exception e)
+        {
+            std::cerr << "Invalid \"bvh\" settings in the scene file." << std::endl;
+            exit(1);
+        }
+    }
+
+    // Deduplication of surfaces that are copies of one mesh (optional)
+    try
+    {
+        this->deduplicate = sceneConfig.value("deduplicate", this->deduplicate);
+    }
+    catch (nlohmann::json::exception e)
+    {
+        std::cerr << "\"deduplicate\" should be true or false." << std::endl;
+        exit(1);
+    }
+
+    // either a path, or {"path": ..., "bvh": {...}} with BVH settings for this file only
+    auto parseSurfaceEntry = [&](const nlohmann::json &surfaceEntry, BVHSettings &surfaceBVHSettings) -> std::string
+    {
+        std::string surfacePath;
+        surfaceBVHSettings = this->bvhSettings;
+        if (surfaceEntry.is_object())
+        {
+            surfacePath = surfaceEntry["path"];
+            if (surfaceEntry.contains("bvh"))
+            {
+                nlohmann::json surfaceBVHConfig = bvhConfig;
+                surfaceBVHConfig.merge_patch(surfaceEntry["bvh"]);
+                surfaceBVHSettings = parseBVHSettings(surfaceBVHConfig);
+            }
+        }
+        else
+        {
+            surfacePath = surfaceEntry;
+        }
+        return sceneDirectory + "/" + surfacePath;
+    };
+
+    // OBJ files whose BVHs are left to the deduplication pass: path, settings, first surface and count
+    std::vector<std::tuple<std::string, BVHSettings, size_t, size_t>> deferredFiles;
+
     // Surface
+    uint32_t surfaceIdx = 0;
     try
     {
         auto surfacePaths = sceneConfig["surface"];
 
-        uint32_t surfaceIdx = 0;
-        for (std::string surfacePath : surfacePaths)
+        for (auto &surfaceEntry : surfacePaths)
         {
-            surfacePath = sceneDirectory + "/" + surfacePath;
-
-            auto surf = createSurfaces(surfacePath, /*isLight=*/false, /*idx=*/surfaceIdx);
+            BVHSettings surfaceBVHSettings;
+            std::string surfacePath = parseSurfaceEntry(surfaceEntry, surfaceBVHSettings);
+            auto surf = createSurfaces(surfacePath, /*isLight=*/false, /*idx=*/surfaceIdx, surfaceBVHSettings,
+                                       /*buildBVH=*/!this->deduplicate);
+            if (this->deduplicate)
+                deferredFiles.push_back(std::make_tuple(surfacePath, surfaceBVHSettings, this->surfaces.size(), surf.size()));
             this->surfaces.insert(this->surfaces.end(), surf.begin(), surf.end());
 
             surfaceIdx = surfaceIdx + surf.size();
         }
-        // Populate BVH
-        
-        // initialize the BVH
-        this->bvh.Num_Of_Surfaces = this->surfaces.size();
-        this->bvh.surfaces = new Surface *[this->bvh.Num_Of_Surfaces];
-        Vector3f min = Vector3f(1e30, 1e30, 1e30);
-        Vector3f max = Vector3f(-1e30, -1e30, -1e30);
-        for (int i = 0; i < this->bvh.Num_Of_Surfaces; ++i)
-        {
-            this->bvh.surfaces[i] = &this->surfaces[i];
-            for (int j = 0; j < 3; ++j)
-            {
-                if (this->surfaces[i].aabb[0][j] < min[j])
-                {
-                    min[j] = this->surfaces[i].aabb[0][j];
-                }
-                if (this->surfaces[i].aabb[1][j] > max[j])
-                {
-                    max[j] = this->surfaces[i].aabb[1][j];
-                }
-            }
-        }
-        this->bvh.aabb[0] = min;
-        this->bvh.aabb[1] = max;
-        this->PopulateBVH(&this->bvh);
-        // this->PrintBVH(&this->bvh, 0);
     }
     catch (nlohmann::json::exception e)
     {
         std::cout << "No surfaces defined." << std::endl;
     }
-}
 
-Interaction Scene::rayIntersect(Ray &ray)   
-{
-    Interaction siFinal;
-    // std:: cout << intersection_type << std::endl;
-    switch (intersection_type)
+    // Meshes and their instances (optional). Every shape of a mesh is loaded and
+    // built once, instances only hold a transform and a pointer to it.
+    std::map<std::string, std::pair<size_t, size_t>> meshRanges; // name -> range of meshes
+    if (sceneConfig.contains("instances"))
     {
-        case 0:
+        try
         {
-            // printf("NAIVE\n");
-
-            for (auto &surface : this->surfaces)
+            for (auto &mesh : sceneConfig["meshes"].items())
             {
-                Interaction si = surface.rayIntersect(ray);
-                if (si.t <= ray.t)
-                {
-                    siFinal = si;
-                    ray.t = si.t;
-                }
+                BVHSettings meshBVHSettings;
+                std::string meshPath = parseSurfaceEntry(mesh.value(), meshBVHSettings);
+                auto surf = createSurfaces(meshPath, /*isLight=*/false, /*idx=*/0, meshBVHSettings);
+                meshRanges[mesh.key()] = std::make_pair(this->meshes.size(), this->meshes.size() + surf.size());
+                this->meshes.insert(this->meshes.end(), surf.begin(), surf.end());
             }
-
-            return siFinal;
         }
-        case 1:
+        catch (nlohmann::json::exception e)
         {
-            // printf("AABB\n");
-            for (auto &surface : this->surfaces)
-            {
-                if (surface.slab_test(ray))
-                {
-                    Interaction si = surface.rayIntersect(ray);
-                    if (si.t <= ray.t)
-                    {
-                        siFinal = si;
-                        ray.t = si.t;
-                    }
-                }
-            }
-
-            return siFinal;
+            std::cerr << "\"meshes\" should map names to OBJ files." << std::endl;
+            exit(1);
         }
-        case 2:
-        case 3:
-        {
-            // printf("BVH\n");
-            // Traverse the BVH to find the Intersecting surfaces
-            BVH_object *interset_obj = this->Traverse_BVH(ray);
+    }
 
-            // if(interset_obj->Num_Of_Surfaces == 2)
-            // {
-            //     printf("useless\n");
-            // }
+    // The pass adds its meshes after the named ones, so it runs before any instance points at them
+    if (this->deduplicate)
+    {
+        this->dedupStats = deduplicateSurfaces(this->surfaces, this->meshes);
 
-            // Intersect the ray with the intersecting surfaces with slab test
-            for (int i = 0; i < interset_obj->Num_Of_Surfaces; ++i)
+        // files without copies were built as usual and can still be cached
+        for (auto &file : deferredFiles)
+        {
+            const std::string &path = std::get<0>(file);
+            const BVHSettings &settings = std::get<1>(file);
+            const Surface *first = this->surfaces.data() + std::get<2>(file);
+            size_t count = std::get<3>(file);
+            bool rebuilt = std::all_of(first, first + count, [](const Surface &surf)
+                                       { return surf.mesh == NULL && !surf.bvh.fromCache; });
+            if (settings.cache && count > 0 && rebuilt)
+                saveMeshCache(path, hashObj(path), settings, first, count);
+        }
+    }
+
+    if (sceneConfig.contains("instances"))
+    {
+        try
+        {
+            for (auto &instance : sceneConfig["instances"])
             {
-                // printf("Surface %d\n", interset_obj->surfaces[i]->shapeIdx);
-                if (interset_obj->surfaces[i]->slab_test(ray))
+                std::string name = instance["mesh"];
+                if (meshRanges.count(name) == 0)
+                {
+                    std::cerr << "Instance of unknown mesh \"" << name << "\"." << std::endl;
+                    exit(1);
+                }
+                Transform toWorld = parseTransform(instance.value("transform", nlohmann::json()));
+                for (size_t i = meshRanges[name].first; i < meshRanges[name].second; ++i)
                 {
-                    Interaction si = interset_obj->surfaces[i]->rayIntersect(ray);
-                    if (si.t <= ray.t)
-                    {
-                        siFinal = si;
-                        ray.t = si.t;
-                    }
+                    this->surfaces.push_back(createInstance(&this->meshes[i], toWorld, surfaceIdx++));
                 }
             }
-
-            return siFinal;
         }
-        default:
+        catch (nlohmann::json::exception e)
         {
-            printf("Invalid intersection type detected\n");
+            std::cerr << "\"instances\" should be a list of {\"mesh\": <name in \"meshes\">, \"transform\": <4x4 matrix>}." << std::endl;
             exit(1);
         }
     }
-}
 
-void Scene::PrintBVH(BVH_object *curNode, int lvl)
-{
-    for (int i = 0; i < lvl; ++i)
+    // Camera-relative coordinates (optional). Every vertex, instance placement and the camera move
+    // by -from once in double, so boxes, triangle records and ray origins, which are float, keep
+    // their precision however far the scene is from the world origin.
+    try
     {
-        printf("  ");
+        if (sceneConfig.value("rebase", false))
+        {
+            this->origin = this->camera.from;
+            for (auto &surface : this->surfaces)
+            {
+                surface.translate(-this->origin);
+            }
+            this->camera = Camera(this->camera.from - this->origin, this->camera.to - this->origin, this->camera.up,
+                                  this->camera.fieldOfView, this->imageResolution);
+        }
     }
-    for (int i = 0; i < curNode->Num_Of_Surfaces; ++i)
+    catch (nlohmann::json::exception e)
     {
-        printf("%d ", curNode->surfaces[i]->shapeIdx);
+        std::cerr << "\"rebase\" should be true or false." << std::endl;
+        exit(1);
     }
-    printf("\n");
-    if (curNode->left != NULL)
+
+    // Accelerator (optional), built over all surfaces
+    std::string acceleratorName = "two_level_bvh";
+    try
     {
-        this->PrintBVH(curNode->left, lvl + 1);
+        acceleratorName = sceneConfig.value("accelerator", acceleratorName);
     }
-    if (curNode->right != NULL)
+    catch (nlohmann::json::exception e)
     {
-        this->PrintBVH(curNode->right, lvl + 1);
+        std::cerr << "\"accelerator\" should be the name of an accelerator." << std::endl;
+        exit(1);
     }
+
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    this->accelerator = createAccelerator(acceleratorName);
+    this->accelerator->build(*this);
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    this->accelerator->stats.buildMs = std::chrono::duration<double, std::milli>(buildEnd - buildStart).count();
 }
-void Scene::PopulateBVH(BVH_object *curNode)
+
+bool Scene::updateVertices(size_t surfaceIdx, const std::vector<Vector3f> &vertices, const std::vector<Vector3f> &normals)
 {
-    // use Median Split to build the BVH
-    // 1. find the longest axis of the bounding box
-    // 2. sort the surfaces based on the longest axis
-    // 3. split the surfaces into two groups
-    // 4. repeat the process for each group until all surface reside in a leaf node
-
-    // check if the current node is a leaf node
-    // printf("%ld ", curNode->Num_Of_Surfaces);
-    // printf("AABB: ");
-    // printf("min: ");
-    // for(int i = 0; i < 3; ++i)
-    // {
-    //     printf("%f ", curNode->aabb[0][i]);
-    // }
-    // printf("max: ");
-    // for(int i = 0; i < 3; ++i)
-    // {
-    //     printf("%f ", curNode->aabb[1][i]);
-    // }
-    // printf("\n");
-    if (curNode->Num_Of_Surfaces <= 1)
-    {
-        // printf("Leaf Node %d\n", curNode->surfaces[0]->shapeIdx);
-        return;
-    }
-
-    // find the longest axis of the bounding box
-    Vector3f box_size = curNode->aabb[1] - curNode->aabb[0];
-    int longest_axis = 0;
-    if (box_size[1] > box_size[0])
-    {
-        longest_axis = 1;
-    }
-    if (box_size[2] > box_size[longest_axis])
-    {
-        longest_axis = 2;
-    }
-
-    // sort the surfaces based on the longest axis
-    std::sort(curNode->surfaces, curNode->surfaces + curNode->Num_Of_Surfaces, [longest_axis](Surface *a, Surface *b) -> bool
-              { return a->aabb[0][longest_axis] < b->aabb[0][longest_axis]; });
-
-    // split the surfaces into two groups
-    BVH_object *left_node = new BVH_object();
-    BVH_object *right_node = new BVH_object();
-    left_node->Num_Of_Surfaces = curNode->Num_Of_Surfaces / 2;
-    right_node->Num_Of_Surfaces = curNode->Num_Of_Surfaces - left_node->Num_Of_Surfaces;
-    left_node->surfaces = new Surface *[left_node->Num_Of_Surfaces];
-    right_node->surfaces = new Surface *[right_node->Num_Of_Surfaces];
-
-    // update the bounding box of the left and right node
-    left_node->aabb[0] = Vector3f(1e30, 1e30, 1e30);
-    left_node->aabb[1] = Vector3f(-1e30, -1e30, -1e30);
-
-    right_node->aabb[0] = Vector3f(1e30, 1e30, 1e30);
-    right_node->aabb[1] = Vector3f(-1e30, -1e30, -1e30);
-
-    // update the surfaces and bounding boxes of the left and right node
-    for (int i = 0; i < left_node->Num_Of_Surfaces; ++i)
-    {
-        left_node->surfaces[i] = curNode->surfaces[i];
-        for (int j = 0; j < 3; ++j)
-        {
-            left_node->aabb[0][j] = std::min(left_node->surfaces[i]->aabb[0][j], left_node->aabb[0][j]);
-            left_node->aabb[1][j] = std::max(left_node->surfaces[i]->aabb[1][j], left_node->aabb[1][j]);
-        }
+    if (surfaceIdx >= this->surfaces.size())
+    {
+        std::cerr << "No surface " << surfaceIdx << " to update." << std::endl;
+        exit(1);
     }
-    for (int i = 0; i < right_node->Num_Of_Surfaces; ++i)
+    if (this->surfaces[surfaceIdx].mesh != NULL)
     {
-        right_node->surfaces[i] = curNode->surfaces[i + left_node->Num_Of_Surfaces];
-        for (int j = 0; j < 3; ++j)
-        {
-            right_node->aabb[0][j] = std::min(right_node->surfaces[i]->aabb[0][j], right_node->aabb[0][j]);
-            right_node->aabb[1][j] = std::max(right_node->surfaces[i]->aabb[1][j], right_node->aabb[1][j]);
-        }
+        std::cerr << "Surface " << surfaceIdx << " is an instance and shares its vertices with other instances." << std::endl;
+        exit(1);
     }
+    if (this->origin == Vector3f(0, 0, 0))
+    {
+        return this->surfaces[surfaceIdx].updateVertices(vertices, normals);
+    }
+    std::vector<Vector3f> rebased(vertices);
+    for (Vector3f &vertex : rebased)
+    {
+        vertex -= this->origin;
+    }
+    return this->surfaces[surfaceIdx].updateVertices(rebased, normals);
+}
 
-    // left_node->aabb[1][longest_axis] = (curNode->surfaces[left_node->Num_Of_Surfaces - 1])->aabb[0][longest_axis];
-    // right_node->aabb[0][longest_axis] = (curNode->surfaces[left_node->Num_Of_Surfaces])->aabb[0][longest_axis];
-
-    // update the current node
-    curNode->left = left_node;
-    curNode->right = right_node;
-
-    // recursively build the BVH
-    this->PopulateBVH(left_node);
-    this->PopulateBVH(right_node);
-
-    return;
+void Scene::refit()
+{
+    this->accelerator->refit(*this);
 }
 
-BVH_object *Scene::Traverse_BVH(Ray& ray)
+Interaction Scene::rayIntersect(Ray &ray)
 {
-    // Traverse the BVH to find the Intersecting surface
-    BVH_object *current_node = &this->bvh;
+    return this->accelerator->rayIntersect(ray);
+}
 
-    while (current_node->left != NULL && current_node->right != NULL)
-    {
-        // check if the ray intersects with the left node
-        if (current_node->left && !current_node->left->slab_test(ray))
-        {
-            current_node = current_node->right;
-        }
-        // check if the ray intersects with the right node
-        else if (current_node->right && !current_node->right->slab_test(ray))
-        {
-            current_node = current_node->left;
-        }
-        else
-        {
-            return current_node;
-        }
-    }
+bool Scene::occluded(const Ray &ray)
+{
+    // the traversals clip to ray.t, so make it the end of the query
+    Ray shadowRay = ray;
+    shadowRay.t = std::min(ray.t, ray.tmax);
 
-    return current_node;
-}
\ No newline at end of file
+    return this->accelerator->occluded(shadowRay);
+}
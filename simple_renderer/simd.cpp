@@ -0,0 +1,123 @@
+#include "simd.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SIMD_X86
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define SIMD_X86
+#endif
+
+namespace simd_sse2 { SimdKernels kernels(); }
+namespace simd_sse4 { SimdKernels kernels(); }
+namespace simd_avx2 { SimdKernels kernels(); }
+namespace simd_avx512 { SimdKernels kernels(); }
+
+SimdKernels simdKernels = simd_sse2::kernels();
+
+#ifdef SIMD_X86
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, int(leaf), int(subleaf));
+    for (int i = 0; i < 4; ++i)
+        regs[i] = unsigned(r[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the operating system saves on context switches (XCR0)
+static uint64_t enabledRegisterState()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (uint64_t(hi) << 32) | lo;
+#endif
+}
+#endif
+
+SimdLevel detectSimdLevel()
+{
+#ifdef SIMD_X86
+    unsigned regs[4];
+    cpuid(0, 0, regs);
+    unsigned maxLeaf = regs[0];
+
+    cpuid(1, 0, regs);
+    bool sse41 = regs[2] & (1u << 19);
+    bool osxsave = regs[2] & (1u << 27);
+    bool avx = regs[2] & (1u << 28);
+    if (!sse41)
+        return SIMD_SSE2;
+
+    // AVX needs the XMM and YMM state saved, AVX-512 the opmask and ZMM state as well
+    uint64_t xcr0 = osxsave ? enabledRegisterState() : 0;
+    if (!avx || (xcr0 & 0x6) != 0x6 || maxLeaf < 7)
+        return SIMD_SSE4;
+
+    cpuid(7, 0, regs);
+    bool avx2 = regs[1] & (1u << 5);
+    bool avx512f = regs[1] & (1u << 16);
+    if (!avx2)
+        return SIMD_SSE4;
+    if (!avx512f || (xcr0 & 0xe6) != 0xe6)
+        return SIMD_AVX2;
+    return SIMD_AVX512;
+#else
+    // other architectures only build the portable kernels
+    return SIMD_SSE2;
+#endif
+}
+
+void selectSimdKernels(SimdLevel level)
+{
+    SimdLevel supported = detectSimdLevel();
+    if (level == SIMD_AUTO)
+        level = supported;
+    if (level > supported)
+    {
+        std::cerr << "This CPU cannot run the " << SimdLevelName(level) << " kernels (it supports up to "
+                  << SimdLevelName(supported) << ")." << std::endl;
+        exit(1);
+    }
+
+    switch (level)
+    {
+    case SIMD_SSE4:
+        simdKernels = simd_sse4::kernels();
+        break;
+    case SIMD_AVX2:
+        simdKernels = simd_avx2::kernels();
+        break;
+    case SIMD_AVX512:
+        simdKernels = simd_avx512::kernels();
+        break;
+    default:
+        simdKernels = simd_sse2::kernels();
+        break;
+    }
+}
+
+std::string SimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_AUTO:
+        return "auto";
+    case SIMD_SSE2:
+        return "sse2";
+    case SIMD_SSE4:
+        return "sse4";
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_AVX512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
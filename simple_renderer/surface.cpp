@@ -1,9 +1,120 @@
 #include "surface.h"
+#include "mesh_cache.h"
 
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+// positions are parsed in double, so a scene far from the origin keeps its precision until
+// it is moved into camera-relative coordinates ("rebase")
 #define TINYOBJLOADER_IMPLEMENTATION
+#define TINYOBJLOADER_USE_DOUBLE
 #include "tinyobjloader/tiny_obj_loader.h"
 
-std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx)
+BVHSettings parseBVHSettings(nlohmann::json bvhConfig)
+{
+    BVHSettings settings;
+
+    std::string builder = bvhConfig.value("builder", std::string("median"));
+    if (builder == "median")
+        settings.builder = BVH_MEDIAN;
+    else if (builder == "sah")
+        settings.builder = BVH_SAH;
+    else if (builder == "lbvh")
+        settings.builder = BVH_LBVH;
+    else if (builder == "sbvh")
+        settings.builder = BVH_SBVH;
+    else
+    {
+        std::cerr << "Unknown BVH builder \"" << builder << "\" (expected \"median\", \"sah\", \"lbvh\" or \"sbvh\")." << std::endl;
+        exit(1);
+    }
+
+    settings.bins = bvhConfig.value("bins", settings.bins);
+    settings.leafCost = bvhConfig.value("leafCost", settings.leafCost);
+    settings.maxLeafSize = bvhConfig.value("maxLeafSize", settings.maxLeafSize);
+    settings.width = bvhConfig.value("width", settings.width);
+    settings.quantized = bvhConfig.value("quantized", settings.quantized);
+    settings.threads = bvhConfig.value("threads", settings.threads);
+    settings.mortonBits = bvhConfig.value("mortonBits", settings.mortonBits);
+    settings.treeletSize = bvhConfig.value("treeletSize", settings.treeletSize);
+    settings.duplicationBudget = bvhConfig.value("duplicationBudget", settings.duplicationBudget);
+    settings.spatialAlpha = bvhConfig.value("spatialAlpha", settings.spatialAlpha);
+    settings.refitThreshold = bvhConfig.value("refitThreshold", settings.refitThreshold);
+    settings.cache = bvhConfig.value("cache", settings.cache);
+
+    if (settings.threads < 0)
+    {
+        std::cerr << "BVH build threads should be >= 0." << std::endl;
+        exit(1);
+    }
+    if (settings.bins < 2 || settings.leafCost <= 0.f || settings.maxLeafSize < 1 || settings.maxLeafSize > 65535)
+    {
+        std::cerr << "BVH settings out of range (bins >= 2, leafCost > 0, 1 <= maxLeafSize <= 65535)." << std::endl;
+        exit(1);
+    }
+    if (settings.mortonBits != 30 && settings.mortonBits != 63)
+    {
+        std::cerr << "LBVH Morton codes should have 30 or 63 bits." << std::endl;
+        exit(1);
+    }
+    if (settings.treeletSize != 0 && (settings.treeletSize < 3 || settings.treeletSize > 8))
+    {
+        std::cerr << "LBVH treelets should have 3 to 8 leaves (0 disables the restructuring)." << std::endl;
+        exit(1);
+    }
+    if (settings.duplicationBudget < 0.f || settings.spatialAlpha < 0.f)
+    {
+        std::cerr << "SBVH duplication budget and spatial alpha should be >= 0." << std::endl;
+        exit(1);
+    }
+    if (settings.refitThreshold < 1.f)
+    {
+        std::cerr << "BVH refit threshold should be >= 1." << std::endl;
+        exit(1);
+    }
+    if (settings.width != 2 && settings.width != 4 && settings.width != 8)
+    {
+        std::cerr << "BVH width should be 2, 4 or 8." << std::endl;
+        exit(1);
+    }
+    if (settings.quantized && (settings.width == 2 || settings.maxLeafSize > 255))
+    {
+        std::cerr << "Quantized BVH nodes need width 4 or 8 and a maxLeafSize of at most 255." << std::endl;
+        exit(1);
+    }
+
+    return settings;
+}
+
+std::string BVHBuilderName(BVHBuilder builder)
+{
+    switch (builder)
+    {
+    case BVH_MEDIAN:
+        return "median";
+    case BVH_SAH:
+        return "sah";
+    case BVH_LBVH:
+        return "lbvh";
+    case BVH_SBVH:
+        return "sbvh";
+    default:
+        return "unknown";
+    }
+}
+
+// Hash of an OBJ corner (position, normal and texcoord index)
+struct CornerHash {
+    size_t operator()(const std::tuple<int, int, int> &c) const
+    {
+        size_t h = std::hash<int>()(std::get<0>(c));
+        h = h * 31 + std::hash<int>()(std::get<1>(c));
+        return h * 31 + std::hash<int>()(std::get<2>(c));
+    }
+};
+
+std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx, const BVHSettings &bvhSettings, bool buildBVH)
 {
     std::string objDirectory;
     const size_t last_slash_idx = pathToObj.rfind('/');
@@ -14,6 +125,17 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
 
     std::vector<Surface> surfaces;
 
+    // the cache holds the parsed surfaces and their BVHs, for this OBJ and these settings only
+    uint64_t objHash = 0;
+    if (bvhSettings.cache)
+    {
+        objHash = hashObj(pathToObj);
+        if (loadMeshCache(pathToObj, objHash, bvhSettings, isLight, shapeIdx, surfaces))
+        {
+            return surfaces;
+        }
+    }
+
     tinyobj::ObjReader reader;
     tinyobj::ObjReaderConfig reader_config;
     if (!reader.ParseFromFile(pathToObj, reader_config))
@@ -42,6 +164,9 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
         surf.shapeIdx = shapeIdx;
         std::set<int> materialIds;
 
+        // corners with the same position, normal and uv are stored once
+        std::unordered_map<std::tuple<int, int, int>, int, CornerHash> cornerIds;
+
         surf.aabb[0] = Vector3f(1e30, 1e30, 1e30);
         surf.aabb[1] = Vector3f(-1e30, -1e30, -1e30);
 
@@ -57,12 +182,22 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
             }
 
             // Loop over vertices in the face. Assume 3 vertices per-face
-            Vector3f vertices[3], normals[3];
-            Vector2f uvs[3];
+            Vector3i findex;
             for (size_t v = 0; v < fv; v++)
             {
                 // access to vertex
                 tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+
+                auto corner = std::make_tuple(idx.vertex_index, idx.normal_index, idx.texcoord_index);
+                auto seen = cornerIds.find(corner);
+                if (seen != cornerIds.end())
+                {
+                    findex[v] = seen->second;
+                    continue;
+                }
+
+                Vector3f vertex, normal;
+                Vector2f uv;
                 tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
                 tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
                 tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
@@ -74,7 +209,7 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
                     tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
                     tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
 
-                    normals[v] = Vector3f(nx, ny, nz);
+                    normal = Vector3f(nx, ny, nz);
                 }
 
                 // Check if `texcoord_index` is zero or positive. negative = no texcoord data
@@ -83,34 +218,25 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
                     tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
                     tinyobj::real_t ty = attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
 
-                    uvs[v] = Vector2f(tx, ty);
+                    uv = Vector2f(tx, ty);
                 }
 
-                vertices[v] = Vector3f(vx, vy, vz);
+                vertex = Vector3f(vx, vy, vz);
 
                 // Update AABB for entire surface
                 for (int i = 0; i < 3; ++i)
                 {
-                    surf.aabb[0][i] = vertices[v][i] < surf.aabb[0][i] ? vertices[v][i] : surf.aabb[0][i];
-                    surf.aabb[1][i] = vertices[v][i] > surf.aabb[1][i] ? vertices[v][i] : surf.aabb[1][i];
+                    surf.aabb[0][i] = vertex[i] < surf.aabb[0][i] ? vertex[i] : surf.aabb[0][i];
+                    surf.aabb[1][i] = vertex[i] > surf.aabb[1][i] ? vertex[i] : surf.aabb[1][i];
                 }
 
-            }
-
-            int vSize = surf.vertices.size();
-            Vector3i findex(vSize, vSize + 1, vSize + 2);
-
-            surf.vertices.push_back(vertices[0]);
-            surf.vertices.push_back(vertices[1]);
-            surf.vertices.push_back(vertices[2]);
+                findex[v] = surf.vertices.size();
+                cornerIds[corner] = findex[v];
 
-            surf.normals.push_back(normals[0]);
-            surf.normals.push_back(normals[1]);
-            surf.normals.push_back(normals[2]);
-
-            surf.uvs.push_back(uvs[0]);
-            surf.uvs.push_back(uvs[1]);
-            surf.uvs.push_back(uvs[2]);
+                surf.vertices.push_back(vertex);
+                surf.normals.push_back(normal);
+                surf.uvs.push_back(uv);
+            }
 
             surf.indices.push_back(findex);
 
@@ -139,56 +265,69 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
                 auto mat = materials[matId];
 
                 surf.diffuse = Vector3f(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
+                surf.diffuseTextureName = mat.diffuse_texname;
                 if (mat.diffuse_texname != "")
                     surf.diffuseTexture = Texture(objDirectory + "/" + mat.diffuse_texname);
 
                 surf.alpha = mat.specular[0];
+                surf.alphaTextureName = mat.alpha_texname;
                 if (mat.alpha_texname != "")
                     surf.alphaTexture = Texture(objDirectory + "/" + mat.alpha_texname);
             }
         }
 
-        // Populate BVH
-        surf.bvh.Num_Of_Triangles = surf.indices.size();
-        surf.bvh.vertices.resize(surf.bvh.Num_Of_Triangles * 3);
-        surf.bvh.normals.resize(surf.bvh.Num_Of_Triangles * 3);
-
-        Vector3f max = Vector3f(-1e30, -1e30, -1e30);
-        Vector3f min = Vector3f(1e30, 1e30, 1e30);
-        for (int i = 0; i < surf.bvh.Num_Of_Triangles; ++i)
-        {
-            surf.bvh.vertices[i * 3] = surf.vertices[i * 3];
-            surf.bvh.vertices[i * 3 + 1] = surf.vertices[i * 3 + 1];
-            surf.bvh.vertices[i * 3 + 2] = surf.vertices[i * 3 + 2];
-
-            for (int j = 0; j < 3; ++j)
-            {
-                max[j] = surf.bvh.vertices[i * 3 + j][j] > max[j] ? surf.bvh.vertices[i * 3 + j][j] : max[j];
-                min[j] = surf.bvh.vertices[i * 3 + j][j] < min[j] ? surf.bvh.vertices[i * 3 + j][j] : min[j];
-            }
-
-            surf.bvh.normals[i * 3] = surf.normals[i * 3];
-            surf.bvh.normals[i * 3 + 1] = surf.normals[i * 3 + 1];
-            surf.bvh.normals[i * 3 + 2] = surf.normals[i * 3 + 2];
-        }
-
-        surf.bvh.aabb[0] = min;
-        surf.bvh.aabb[1] = max;
+        surf.vertices.shrink_to_fit();
+        surf.normals.shrink_to_fit();
+        surf.uvs.shrink_to_fit();
+        surf.indices.shrink_to_fit();
 
-        surf.bvh.left = NULL;
-        surf.bvh.right = NULL;
-
-        surf.PopulateBVH(&surf.bvh);
-        // surf.PrintBVH(&surf.bvh, 0);
-        // surf.UpdateAABB(&surf.bvh);
+        // Populate BVH, or only note the settings for whoever builds it later
+        if (buildBVH)
+            surf.PopulateBVH(bvhSettings);
+        else
+            surf.bvh.settings = bvhSettings;
+        // surf.PrintBVH(0, 0);
 
-        surfaces.push_back(surf);
+        surfaces.push_back(std::move(surf));
         shapeIdx++;
     }
 
+    if (bvhSettings.cache && buildBVH)
+    {
+        saveMeshCache(pathToObj, objHash, bvhSettings, surfaces.data(), surfaces.size());
+    }
+
     return surfaces;
 }
 
+Surface createInstance(Surface *mesh, const Transform &toWorld, uint32_t shapeIdx)
+{
+    Surface surf;
+    surf.isLight = mesh->isLight;
+    surf.shapeIdx = shapeIdx;
+    surf.diffuse = mesh->diffuse;
+    surf.alpha = mesh->alpha;
+    surf.diffuseTexture = mesh->diffuseTexture;
+    surf.alphaTexture = mesh->alphaTexture;
+    surf.mesh = mesh;
+    surf.toWorld = toWorld;
+    surf.toObject = toWorld.inverse();
+
+    // the world box of the instance holds the corners of the box of the mesh
+    surf.aabb[0] = Vector3f(1e30, 1e30, 1e30);
+    surf.aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        Vector3f p = toWorld.point(Vector3f(mesh->aabb[corner & 1].x, mesh->aabb[(corner >> 1) & 1].y, mesh->aabb[corner >> 2].z));
+        for (int i = 0; i < 3; ++i)
+        {
+            surf.aabb[0][i] = std::min(surf.aabb[0][i], p[i]);
+            surf.aabb[1][i] = std::max(surf.aabb[1][i], p[i]);
+        }
+    }
+    return surf;
+}
+
 bool Surface::hasDiffuseTexture() { return this->diffuseTexture.data != 0; }
 
 bool Surface::hasAlphaTexture() { return this->alphaTexture.data != 0; }
@@ -259,201 +398,322 @@ Interaction Surface::rayTriangleIntersect(Ray ray, Vector3f v1, Vector3f v2, Vec
 
 Interaction Surface::rayIntersect(Ray ray)
 {
-    if (intersection_type < 3)
+    // BVH for triangles
+    return this->Traverse_BVH(ray);
+}
+
+bool Surface::occluded(const Ray &ray)
+{
+    if (this->bvh.width == 4)
+    {
+        return this->bvh.quantized ? this->occludedWideBVH<4>(ray, this->bvh.quantized4) : this->occludedWideBVH<4>(ray, this->bvh.nodes4);
+    }
+    if (this->bvh.width == 8)
     {
-        Interaction siFinal;
-        float tmin = ray.t;
+        return this->bvh.quantized ? this->occludedWideBVH<8>(ray, this->bvh.quantized8) : this->occludedWideBVH<8>(ray, this->bvh.nodes8);
+    }
+    return this->occludedBVH(ray);
+}
 
-        for (auto face : this->indices)
+bool Surface::occludedFaces(const Ray &ray)
+{
+    for (uint32_t i = 0; i < this->indices.size(); ++i)
+    {
+        const Vector3i &face = this->indices[i];
+        ray_stats.triangleTests++;
+        Interaction si = this->rayTriangleIntersect(ray, this->vertices[face.x], this->vertices[face.y], this->vertices[face.z], this->triangles.normals[i]);
+        if (si.didIntersect && si.t <= ray.t)
         {
-            Vector3f p1 = this->vertices[face.x];
-            Vector3f p2 = this->vertices[face.y];
-            Vector3f p3 = this->vertices[face.z];
+            return true;
+        }
+    }
+    return false;
+}
 
-            Vector3f n1 = this->normals[face.x];
-            Vector3f n2 = this->normals[face.y];
-            Vector3f n3 = this->normals[face.z];
-            Vector3f n = Normalize(n1 + n2 + n3);
+bool Surface::occludedLeaf(const Ray &ray, uint32_t begin, uint32_t end)
+{
+    ray_stats.triangleTests += end - begin;
+    return occludesTriangles(this->triangles, ray, begin, end, ray.t);
+}
 
-            Interaction si = this->rayTriangleIntersect(ray, p1, p2, p3, n);
-            if (si.t <= tmin && si.didIntersect)
-            {
-                siFinal = si;
-                tmin = si.t;
-            }
-        }
+Interaction Surface::rayIntersectFaces(Ray &ray, uint32_t begin, uint32_t end)
+{
+    Interaction siFinal;
 
-        return siFinal;
-    }
-    else if (intersection_type == 3)
+    for (uint32_t i = begin; i < end; ++i)
     {
-        // BVH for triangles
-        Interaction siFinal;
-        float tmin = ray.t;
-        BVH_Triangles *bvh = this->Traverse_BVH(ray);
-        // printf("hello\n");
-        if (bvh == NULL)
+        const Vector3i &face = this->indices[i];
+        Vector3f p1 = this->vertices[face.x];
+        Vector3f p2 = this->vertices[face.y];
+        Vector3f p3 = this->vertices[face.z];
+
+        Vector3f n1 = this->normals[face.x];
+        Vector3f n2 = this->normals[face.y];
+        Vector3f n3 = this->normals[face.z];
+        Vector3f n = Normalize(n1 + n2 + n3);
+
+        ray_stats.triangleTests++;
+        Interaction si = this->rayTriangleIntersect(ray, p1, p2, p3, n);
+        if (si.t <= ray.t && si.didIntersect)
         {
-            // printf("No intersection with BVH\n");
-            siFinal.didIntersect = false;
-            return siFinal;
+            siFinal = si;
+            ray.t = si.t;
         }
-        // printf("Intersecting with BVH\n");
-        // printf("Number of triangles in BVH: %ld\n", bvh->Num_Of_Triangles);
-        // NAIVE intersection check for  all triangles in BVH
-
-        for (int i = 0; i < bvh->Num_Of_Triangles; ++i)
-        {
-            // slab test
-            Vector3f p1 = bvh->vertices[i * 3];
-            Vector3f p2 = bvh->vertices[i * 3 + 1];
-            Vector3f p3 = bvh->vertices[i * 3 + 2];
-
-            // slab test
-            {
-                Vector3f AaBb[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
-
-                for(int j = 0; j < 3; ++j)
-                {
-                    AaBb[0][j] = std::min(AaBb[0][j], p1[j]);
-                    AaBb[0][j] = std::min(AaBb[0][j], p2[j]);
-                    AaBb[0][j] = std::min(AaBb[0][j], p3[j]);
+    }
 
-                    AaBb[1][j] = std::max(AaBb[1][j], p1[j]);
-                    AaBb[1][j] = std::max(AaBb[1][j], p2[j]);
-                    AaBb[1][j] = std::max(AaBb[1][j], p3[j]);
-                }
+    return siFinal;
+}
 
-                float tmin = -1e30, tmax = 1e30;
-                for (int i = 0; i < 3; ++i)
-                {
-                    float t1 = (AaBb[0][i] - ray.o[i]) / ray.d[i];
-                    float t2 = (AaBb[1][i] - ray.o[i]) / ray.d[i];
-                    tmin = std::max(tmin, std::min(t1, t2));
-                    tmax = std::min(tmax, std::max(t1, t2));
-                }
-                if(tmax < tmin)
-                {
-                    // printf("Not intersecting with triangle\n");
-                    continue;
-                }
-            }
+Interaction Surface::rayIntersectLeaf(Ray &ray, uint32_t begin, uint32_t end)
+{
+    Interaction siFinal;
 
-            Vector3f n1 = bvh->normals[i * 3];
-            Vector3f n2 = bvh->normals[i * 3 + 1];
-            Vector3f n3 = bvh->normals[i * 3 + 2];
-            Vector3f n = Normalize(n1 + n2 + n3);
+    ray_stats.triangleTests += end - begin;
+    float t;
+    long int face = intersectTriangles(this->triangles, ray, begin, end, ray.t, t);
+    if (face != -1)
+    {
+        siFinal.didIntersect = true;
+        siFinal.t = t;
+        siFinal.n = this->triangles.normals[face];
+        siFinal.p = ray.o + ray.d * t;
+        ray.t = t;
+    }
 
-            Interaction si = this->rayTriangleIntersect(ray, p1, p2, p3, n);
-            if (si.t <= tmin && si.didIntersect)
-            {
-                siFinal = si;
-                tmin = si.t;
-            }
-        }
+    return siFinal;
+}
 
-        return siFinal;
-    }
-    else
+static void expandBounds(Vector3f aabb[2], const Vector3f &p)
+{
+    for (int j = 0; j < 3; ++j)
     {
-        std::cerr << "Invalid intersection type detected\n";
-        exit(1);
+        aabb[0][j] = std::min(aabb[0][j], p[j]);
+        aabb[1][j] = std::max(aabb[1][j], p[j]);
     }
 }
 
-bool Surface::slab_test(Ray &ray)
+static double surfaceArea(const Vector3f aabb[2])
 {
-    float tmin = -1e30, tmax = 1e30;
-    for (int i = 0; i < 3; ++i)
+    Vector3f d = aabb[1] - aabb[0];
+    if (d.x < 0 || d.y < 0 || d.z < 0)
     {
-        float t1 = (this->aabb[0][i] - ray.o[i]) / ray.d[i];
-        float t2 = (this->aabb[1][i] - ray.o[i]) / ray.d[i];
-        tmin = std::max(tmin, std::min(t1, t2));
-        tmax = std::min(tmax, std::max(t1, t2));
+        return 0.0;
     }
-    return tmax >= tmin;
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
 }
 
-// #define MARGIN -1
-bool BVH_object::slab_test(Ray &ray)
+// Store double precision bounds in a node, rounded outwards so the float box
+// always contains the triangles
+static void storeBounds(BVHNode &node, const Vector3f aabb[2])
 {
-    float tmin = -1e30, tmax = 1e30;
-    for (int i = 0; i < 3; ++i)
+    for (int j = 0; j < 3; ++j)
     {
-        float t1 = (this->aabb[0][i] - ray.o[i]) / ray.d[i];
-        float t2 = (this->aabb[1][i] - ray.o[i]) / ray.d[i];
-        tmin = std::max(tmin, std::min(t1, t2));
-        tmax = std::min(tmax, std::max(t1, t2));
+        float lo = float(aabb[0][j]), hi = float(aabb[1][j]);
+        node.aabb[0][j] = lo > aabb[0][j] ? std::nextafter(lo, -INFINITY) : lo;
+        node.aabb[1][j] = hi < aabb[1][j] ? std::nextafter(hi, INFINITY) : hi;
     }
-    // if(tmax >= tmin)
-    // {
-    //     // printf("tmax: %f, tmin: %f\n", tmax, tmin);
-    //     // printf("tmax >= tmin\n");
-    //     printf("Intersecting with BVH\n");
-    // }
-    // else
-    // {
-    //     printf("Not intersecting with BVH\n");
-    //     // printf("tmax: %f, tmin: %f\n", tmax, tmin);
-    //     // printf("tmax < tmin\n");
-    // }
+}
+
+// Per-triangle data that is only needed while building
+struct BVHBuildTriangle {
+    Vector3f aabb[2];
+    Vector3f centroid;
+};
 
-    return tmax >= tmin;
+// Nodes over fewer triangles are built by a single thread
+#define BVH_PARALLEL_MIN_TRIANGLES 16384
+
+// Run fn(chunk, begin, end) over [0, count) split into numChunks ranges, each on its own thread
+template <typename Fn>
+static void parallelChunks(long int count, int numChunks, Fn fn)
+{
+    std::vector<std::thread> workers;
+    for (int c = 1; c < numChunks; ++c)
+    {
+        workers.emplace_back(fn, c, count * c / numChunks, count * (c + 1) / numChunks);
+    }
+    fn(0, 0, count / numChunks);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
 }
 
-bool BVH_Triangles::slab_test(Ray &ray)
+// Centroid bins of all three axes, filled in one pass over the triangles
+struct SAHBins {
+    std::vector<long int> count;  // [axis * numBins + bin]
+    std::vector<Vector3f> bounds; // [(axis * numBins + bin) * 2], min and max
+};
+
+// Best binned SAH object split over the triangle centroids in tris[0, count)
+struct ObjectSplit {
+    int axis = -1;      // -1 if all centroids coincide
+    int bin = -1;       // the left child gets the bins up to and including this one
+    double scale = 0;   // bins per unit length along axis
+    double cost = 1e30; // area-weighted triangle count of both children
+    Vector3f left[2], right[2]; // bounds of the children
+};
+
+static ObjectSplit findObjectSplit(const std::vector<BVHBuildTriangle> &buildTris, const uint32_t *tris, long int count,
+                                   const Vector3f centroidBounds[2], const BVHSettings &settings, int threads)
 {
-    float tmin = -1e30, tmax = 1e30;
-    for (int i = 0; i < 3; ++i)
+    const int numBins = settings.bins;
+    ObjectSplit best;
+
+    double scale[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        double extent = centroidBounds[1][axis] - centroidBounds[0][axis];
+        scale[axis] = extent > 0 ? numBins / extent : 0.0;
+    }
+
+    // bin the triangles by centroid; large nodes are binned in chunks on every
+    // thread and the chunk bins merged, which gives exactly the serial bins
+    int numChunks = count >= BVH_PARALLEL_MIN_TRIANGLES ? threads : 1;
+    std::vector<SAHBins> chunkBins(numChunks);
+    parallelChunks(count, numChunks, [&](int chunk, long int begin, long int end)
+                   {
+        SAHBins &bins = chunkBins[chunk];
+        bins.count.assign(3 * numBins, 0);
+        bins.bounds.resize(3 * numBins * 2);
+        for (int b = 0; b < 3 * numBins; ++b)
+        {
+            bins.bounds[b * 2] = Vector3f(1e30, 1e30, 1e30);
+            bins.bounds[b * 2 + 1] = Vector3f(-1e30, -1e30, -1e30);
+        }
+        for (long int i = begin; i < end; ++i)
+        {
+            const BVHBuildTriangle &tri = buildTris[tris[i]];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int b = axis * numBins + std::min(numBins - 1, int((tri.centroid[axis] - centroidBounds[0][axis]) * scale[axis]));
+                bins.count[b]++;
+                expandBounds(&bins.bounds[b * 2], tri.aabb[0]);
+                expandBounds(&bins.bounds[b * 2], tri.aabb[1]);
+            }
+        } });
+    SAHBins &bins = chunkBins[0];
+    for (int c = 1; c < numChunks; ++c)
+    {
+        for (int b = 0; b < 3 * numBins; ++b)
+        {
+            if (chunkBins[c].count[b] == 0)
+            {
+                continue;
+            }
+            bins.count[b] += chunkBins[c].count[b];
+            expandBounds(&bins.bounds[b * 2], chunkBins[c].bounds[b * 2]);
+            expandBounds(&bins.bounds[b * 2], chunkBins[c].bounds[b * 2 + 1]);
+        }
+    }
+
+    std::vector<Vector3f> rightBounds(numBins * 2);
+    for (int axis = 0; axis < 3; ++axis)
     {
-        float t1 = (this->aabb[0][i] - ray.o[i]) / ray.d[i];
-        float t2 = (this->aabb[1][i] - ray.o[i]) / ray.d[i];
-        tmin = std::max(tmin, std::min(t1, t2));
-        tmax = std::min(tmax, std::max(t1, t2));
+        if (scale[axis] == 0.0)
+        {
+            continue;
+        }
+        const long int *binCount = &bins.count[axis * numBins];
+        const Vector3f *binBounds = &bins.bounds[axis * numBins * 2];
+
+        // sweep from the right to get the area of every right partition
+        Vector3f bounds[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+        for (int b = numBins - 1; b > 0; --b)
+        {
+            if (binCount[b] > 0)
+            {
+                expandBounds(bounds, binBounds[b * 2]);
+                expandBounds(bounds, binBounds[b * 2 + 1]);
+            }
+            rightBounds[b * 2] = bounds[0];
+            rightBounds[b * 2 + 1] = bounds[1];
+        }
+
+        // sweep from the left and evaluate the split after every bin
+        bounds[0] = Vector3f(1e30, 1e30, 1e30);
+        bounds[1] = Vector3f(-1e30, -1e30, -1e30);
+        long int countLeft = 0;
+        for (int b = 0; b < numBins - 1; ++b)
+        {
+            if (binCount[b] > 0)
+            {
+                expandBounds(bounds, binBounds[b * 2]);
+                expandBounds(bounds, binBounds[b * 2 + 1]);
+            }
+            countLeft += binCount[b];
+
+            long int countRight = count - countLeft;
+            if (countLeft == 0 || countRight == 0)
+            {
+                continue;
+            }
+            double cost = surfaceArea(bounds) * countLeft + surfaceArea(&rightBounds[(b + 1) * 2]) * countRight;
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.scale = scale[axis];
+                best.left[0] = bounds[0];
+                best.left[1] = bounds[1];
+                best.right[0] = rightBounds[(b + 1) * 2];
+                best.right[1] = rightBounds[(b + 1) * 2 + 1];
+            }
+        }
     }
-    // if(tmax >= tmin)
-    // {
-    //     // printf("tmax: %f, tmin: %f\n", tmax, tmin);
-    //     // printf("tmax >= tmin\n");
-    //     printf("Intersecting with BVH\n");
-    // }
-    // else
-    // {
-    //     printf("Not intersecting with BVH\n");
-    //     // printf("tmax: %f, tmin: %f\n", tmax, tmin);
-    //     // printf("tmax < tmin\n");
-    // }
 
-    return tmax >= tmin;
+    return best;
 }
 
-void Surface::PopulateBVH(BVH_Triangles *bvh)
+// Binned SAH split over the triangle centroids in tris[0, count).
+// Returns false if keeping the node as a leaf is cheaper, otherwise partitions
+// tris so that the numLeft triangles of the left child come first.
+static bool splitSAH(const std::vector<BVHBuildTriangle> &buildTris, uint32_t *tris, long int count,
+                     const Vector3f aabb[2], const Vector3f centroidBounds[2],
+                     const BVHSettings &settings, int threads, long int &numLeft, int &splitAxis)
 {
-    // printf("Populating BVH\n");
-    if (bvh->Num_Of_Triangles <= 4)
+    ObjectSplit best = findObjectSplit(buildTris, tris, count, centroidBounds, settings, threads);
+
+    // all centroids coincide, nothing to split on
+    if (best.axis == -1)
     {
-        return;
+        if (count <= settings.maxLeafSize)
+        {
+            return false;
+        }
+        numLeft = count / 2;
+        splitAxis = 0;
+        return true;
     }
 
-    float factor = 1.0f / 3.0f;
-    std::vector<std::tuple<Vector3f, Vector3f, int>> vertices_normals_indices;
-    vertices_normals_indices.reserve(bvh->Num_Of_Triangles);
-
-    for (int i = 0; i < bvh->Num_Of_Triangles; ++i)
+    // cost of a split: one traversal step plus the expected number of triangle tests
+    double splitCost = 1.0 + settings.leafCost * best.cost / surfaceArea(aabb);
+    double leafCost = settings.leafCost * count;
+    if (leafCost <= splitCost && count <= settings.maxLeafSize)
     {
-        Vector3f v1 = bvh->vertices[i * 3];
-        Vector3f v2 = bvh->vertices[i * 3 + 1];
-        Vector3f v3 = bvh->vertices[i * 3 + 2];
+        return false;
+    }
+
+    uint32_t *mid = std::partition(tris, tris + count, [&](uint32_t i)
+                                   { return std::min(settings.bins - 1, int((buildTris[i].centroid[best.axis] - centroidBounds[0][best.axis]) * best.scale)) <= best.bin; });
+    numLeft = mid - tris;
+    splitAxis = best.axis;
 
-        Vector3f n1 = bvh->normals[i * 3];
-        Vector3f n2 = bvh->normals[i * 3 + 1];
-        Vector3f n3 = bvh->normals[i * 3 + 2];
+    return true;
+}
 
-        vertices_normals_indices.emplace_back(factor * (v1 + v2 + v3), factor * (n1 + n2 + n3), i);
+// Median split along the longest axis of the node
+static bool splitMedian(const std::vector<BVHBuildTriangle> &buildTris, uint32_t *tris, long int count,
+                        const Vector3f aabb[2], const BVHSettings &settings, long int &numLeft, int &splitAxis)
+{
+    if (count <= settings.maxLeafSize)
+    {
+        return false;
     }
 
     int longest_axis = 0;
-    Vector3f aabb_size = bvh->aabb[1] - bvh->aabb[0];
+    Vector3f aabb_size = aabb[1] - aabb[0];
 
     if (aabb_size[1] > aabb_size[0])
     {
@@ -464,141 +724,1655 @@ void Surface::PopulateBVH(BVH_Triangles *bvh)
         longest_axis = 2;
     }
 
-    std::sort(vertices_normals_indices.begin(), vertices_normals_indices.end(),
-              [longest_axis](const auto &a, const auto &b)
-              {
-                  return std::get<0>(a)[longest_axis] < std::get<0>(b)[longest_axis];
-              });
-
-    BVH_Triangles* bvh_left = new BVH_Triangles();
-    BVH_Triangles* bvh_right = new BVH_Triangles();
+    // only the median has to be in place, so a linear selection replaces the full sort
+    numLeft = count / 2;
+    std::nth_element(tris, tris + numLeft, tris + count,
+                     [&](uint32_t a, uint32_t b)
+                     {
+                         return buildTris[a].centroid[longest_axis] < buildTris[b].centroid[longest_axis];
+                     });
 
-    bvh_left->Num_Of_Triangles = bvh->Num_Of_Triangles / 2;
-    bvh_right->Num_Of_Triangles = bvh->Num_Of_Triangles - bvh_left->Num_Of_Triangles;
-
-
-    bvh_left->vertices.reserve(bvh_left->Num_Of_Triangles * 3);
-    bvh_left->normals.reserve(bvh_left->Num_Of_Triangles * 3);
-
-    bvh_right->vertices.reserve(bvh_right->Num_Of_Triangles * 3);
-    bvh_right->normals.reserve(bvh_right->Num_Of_Triangles * 3);
+    splitAxis = longest_axis;
+    return true;
+}
 
-    Vector3f max = Vector3f(-1e30,-1e30,-1e30);
-    Vector3f min = Vector3f(1e30,1e30,1e30);
+// Append a subtree that was built into its own array and return the index of its root.
+// Right child offsets are relative to that array and are shifted on the way,
+// leaf offsets are shifted by leafShift.
+static uint32_t spliceNodes(std::vector<BVHNode> &nodes, const std::vector<BVHNode> &subtree, uint32_t leafShift = 0)
+{
+    uint32_t root = nodes.size();
+    for (BVHNode node : subtree)
+    {
+        node.offset += node.isLeaf() ? leafShift : root;
+        nodes.push_back(node);
+    }
+    return root;
+}
 
-    for (int i = 0; i < bvh_left->Num_Of_Triangles; ++i)
+// Build the subtree over order[first, first + count) and append its nodes
+// depth-first. Returns the index of the subtree root. While more than one
+// thread is left, the right subtree of a large node is built on a new thread
+// into its own array and spliced in after the left subtree.
+static uint32_t buildBVHNode(std::vector<BVHNode> &nodes, const std::vector<BVHBuildTriangle> &buildTris,
+                             std::vector<uint32_t> &order, uint32_t first, long int count, const BVHSettings &settings,
+                             int depth, int threads)
+{
+    uint32_t *tris = order.data() + first;
+    bool parallel = threads > 1 && count >= BVH_PARALLEL_MIN_TRIANGLES;
+
+    Vector3f aabb[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    Vector3f centroidBounds[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    int numChunks = parallel ? threads : 1;
+    std::vector<Vector3f> chunkBounds(numChunks * 4);
+    parallelChunks(count, numChunks, [&](int chunk, long int begin, long int end)
+                   {
+        Vector3f *bounds = &chunkBounds[chunk * 4];
+        bounds[0] = bounds[2] = Vector3f(1e30, 1e30, 1e30);
+        bounds[1] = bounds[3] = Vector3f(-1e30, -1e30, -1e30);
+        for (long int i = begin; i < end; ++i)
+        {
+            expandBounds(bounds, buildTris[tris[i]].aabb[0]);
+            expandBounds(bounds, buildTris[tris[i]].aabb[1]);
+            expandBounds(bounds + 2, buildTris[tris[i]].centroid);
+        } });
+    for (int c = 0; c < numChunks; ++c)
     {
-        // Copy vertices and normals
-        // Update bounding box of the left node
-        // max = bvh_left->vertices[i * 3];
-        // min = bvh_left->vertices[i * 3];
-        for (int j = 0; j < 3; ++j)
+        // an empty chunk still has its inverted initial bounds
+        if (count * (c + 1) / numChunks == count * c / numChunks)
         {
-            bvh_left->vertices.emplace_back(bvh->vertices[i * 3 + j]);
-            bvh_left->normals.emplace_back(bvh->normals[i * 3 + j]);
-
-            max[j] = std::max(max[j], bvh_left->vertices[i * 3 + j][j]);
-            min[j] = std::min(min[j], bvh_left->vertices[i * 3 + j][j]);
+            continue;
         }
+        expandBounds(aabb, chunkBounds[c * 4]);
+        expandBounds(aabb, chunkBounds[c * 4 + 1]);
+        expandBounds(centroidBounds, chunkBounds[c * 4 + 2]);
+        expandBounds(centroidBounds, chunkBounds[c * 4 + 3]);
     }
-    bvh_left->aabb[0] = min;
-    bvh_left->aabb[1] = max;
 
-    max = Vector3f(-1e30, -1e30, -1e30);
-    min = Vector3f(1e30, 1e30, 1e30);
+    uint32_t nodeIdx = nodes.size();
+    nodes.emplace_back();
+    storeBounds(nodes[nodeIdx], aabb);
+
+    long int numLeft = 0;
+    int axis = 0;
+    // past half the traversal stack the balanced median split keeps the tree shallow enough
+    bool useSAH = settings.builder == BVH_SAH && depth < BVH_STACK_SIZE / 2;
+    bool split = count > 1 && (useSAH
+                                   ? splitSAH(buildTris, tris, count, aabb, centroidBounds, settings, numChunks, numLeft, axis)
+                                   : splitMedian(buildTris, tris, count, aabb, settings, numLeft, axis));
+    if (!split)
+    {
+        nodes[nodeIdx].offset = first;
+        nodes[nodeIdx].Num_Of_Triangles = count;
+        return nodeIdx;
+    }
 
-    for (int i = 0; i < bvh_right->Num_Of_Triangles; ++i)
-    {    // Copy vertices and normals
-        // Update bounding box of the right node
-        // max = bvh_right->vertices[i * 3];
-        // min = bvh_right->vertices[i * 3];
-        for (int j = 0; j < 3; ++j)
-        {
-            bvh_right->vertices.emplace_back(bvh->vertices[(i + bvh_left->Num_Of_Triangles) * 3 + j]);
-            bvh_right->normals.emplace_back(bvh->normals[(i + bvh_left->Num_Of_Triangles) * 3 + j]);
+    nodes[nodeIdx].axis = axis;
 
-            max[j] = std::max(max[j], bvh_right->vertices[i * 3 + j][j]);
-            min[j] = std::min(min[j], bvh_right->vertices[i * 3 + j][j]);
-        }
+    // the left child directly follows its parent, the right child comes after the left subtree
+    if (!parallel)
+    {
+        buildBVHNode(nodes, buildTris, order, first, numLeft, settings, depth + 1, 1);
+        uint32_t right = buildBVHNode(nodes, buildTris, order, first + numLeft, count - numLeft, settings, depth + 1, 1);
+        nodes[nodeIdx].offset = right;
+        return nodeIdx;
     }
-    bvh_right->aabb[0] = min;
-    bvh_right->aabb[1] = max;
 
-    bvh->left = bvh_left;
-    bvh->right = bvh_right;
-
-    PopulateBVH(bvh->left);
-    PopulateBVH(bvh->right);
+    std::vector<BVHNode> rightNodes;
+    rightNodes.reserve(2 * (count - numLeft));
+    int rightThreads = threads / 2;
+    std::thread rightBuild([&]()
+                           { buildBVHNode(rightNodes, buildTris, order, first + numLeft, count - numLeft, settings, depth + 1, rightThreads); });
+    buildBVHNode(nodes, buildTris, order, first, numLeft, settings, depth + 1, threads - rightThreads);
+    rightBuild.join();
+    uint32_t right = spliceNodes(nodes, rightNodes);
+    nodes[nodeIdx].offset = right;
+
+    return nodeIdx;
 }
-void Surface::PrintBVH(BVH_Triangles *bvh, int lvl)
+
+// Spatial split BVH (Stich et al. 2009). Nodes are built over references:
+// boxes around the part of a triangle that falls inside the node. Besides the
+// object split, a node may split space at a plane, clipping the references
+// that straddle it into both children. This separates large triangles whose
+// boxes would otherwise overlap most of the tree, at the cost of referencing
+// them from several leaves.
+struct SBVHBuild {
+    const std::vector<Vector3f> &vertices;
+    const std::vector<Vector3i> &indices;
+    const BVHSettings &settings;
+    double rootArea;
+};
+
+// Bounds of the part of a triangle between two planes along axis, within box.
+// Returns false if no part of the triangle is left.
+static bool clipTriangle(const SBVHBuild &build, uint32_t tri, const Vector3f box[2], int axis, double lo, double hi, Vector3f clipped[2])
 {
-    for (int i = 0; i < lvl; ++i)
-    {
-        printf("  ");
-    }
-    for (int i = 0; i < bvh->Num_Of_Triangles; ++i)
-    {
-        printf("%d ", i + 1);
-        // printf("vertices(%f, %f, %f) ", bvh->vertices[i][0], bvh->vertices[i][1], bvh->vertices[i][2]);
-    }
-    printf("\n");
-    if (bvh->left != NULL)
+    const Vector3i &face = build.indices[tri];
+    Vector3f v[3] = {build.vertices[face.x], build.vertices[face.y], build.vertices[face.z]};
+
+    clipped[0] = Vector3f(1e30, 1e30, 1e30);
+    clipped[1] = Vector3f(-1e30, -1e30, -1e30);
+    for (int e = 0; e < 3; ++e)
     {
-        this->PrintBVH(bvh->left, lvl + 1);
+        const Vector3f &a = v[e], &b = v[(e + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi)
+        {
+            expandBounds(clipped, a);
+        }
+        // points where the edge crosses either plane
+        for (double plane : {lo, hi})
+        {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+            {
+                Vector3f p = a + ((plane - a[axis]) / (b[axis] - a[axis])) * (b - a);
+                p[axis] = plane;
+                expandBounds(clipped, p);
+            }
+        }
     }
-    if (bvh->right != NULL)
+
+    for (int j = 0; j < 3; ++j)
     {
-        this->PrintBVH(bvh->right, lvl + 1);
+        clipped[0][j] = std::max(clipped[0][j], box[0][j]);
+        clipped[1][j] = std::min(clipped[1][j], box[1][j]);
+        if (clipped[0][j] > clipped[1][j])
+        {
+            return false;
+        }
     }
+    return true;
 }
-BVH_Triangles *Surface::Traverse_BVH(Ray &ray)
+
+// Best binned spatial split of a node: every reference is clipped into all the
+// bins it overlaps; it enters the left child's count in its first bin and the
+// right child's count in its last bin.
+struct SpatialSplit {
+    int axis = -1;
+    double position = 0;
+    double cost = 1e30;
+    long int numLeft = 0, numRight = 0;
+};
+
+static SpatialSplit findSpatialSplit(const SBVHBuild &build, const std::vector<BVHBuildTriangle> &refs,
+                                     const std::vector<uint32_t> &refTris, const Vector3f aabb[2])
 {
-    BVH_Triangles *current_node = &this->bvh;
-    // printf("Traversing BVH\n");
+    const int numBins = build.settings.bins;
+    SpatialSplit best;
 
-    while (current_node->left != NULL && current_node->right != NULL)
+    std::vector<Vector3f> binBounds(numBins * 2), rightBounds(numBins * 2);
+    std::vector<long int> entries(numBins), exits(numBins), rightCount(numBins);
+    for (int axis = 0; axis < 3; ++axis)
     {
-        // check if the ray intersects with the left node
-        if (current_node->left && !current_node->left->slab_test(ray))
+        double extent = aabb[1][axis] - aabb[0][axis];
+        if (extent <= 0)
         {
-            current_node = current_node->right;
+            continue;
         }
-        // check if the ray intersects with the right node
-        else if (current_node->right && !current_node->right->slab_test(ray))
+        double scale = numBins / extent;
+        auto binOf = [&](double x)
+        { return std::max(0, std::min(numBins - 1, int((x - aabb[0][axis]) * scale))); };
+
+        for (int b = 0; b < numBins; ++b)
         {
-            current_node = current_node->left;
+            binBounds[b * 2] = Vector3f(1e30, 1e30, 1e30);
+            binBounds[b * 2 + 1] = Vector3f(-1e30, -1e30, -1e30);
+            entries[b] = exits[b] = 0;
         }
-        else
+        for (size_t i = 0; i < refs.size(); ++i)
+        {
+            const BVHBuildTriangle &ref = refs[i];
+            int first = binOf(ref.aabb[0][axis]), last = binOf(ref.aabb[1][axis]);
+            entries[first]++;
+            exits[last]++;
+            if (first == last)
+            {
+                expandBounds(&binBounds[first * 2], ref.aabb[0]);
+                expandBounds(&binBounds[first * 2], ref.aabb[1]);
+                continue;
+            }
+            for (int b = first; b <= last; ++b)
+            {
+                Vector3f clipped[2];
+                double lo = aabb[0][axis] + b / scale;
+                double hi = b == numBins - 1 ? aabb[1][axis] : aabb[0][axis] + (b + 1) / scale;
+                if (clipTriangle(build, refTris[i], ref.aabb, axis, lo, hi, clipped))
+                {
+                    expandBounds(&binBounds[b * 2], clipped[0]);
+                    expandBounds(&binBounds[b * 2], clipped[1]);
+                }
+            }
+        }
+
+        // sweep from the right, then evaluate every plane between two bins from the left
+        Vector3f bounds[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+        long int count = 0;
+        for (int b = numBins - 1; b > 0; --b)
+        {
+            expandBounds(bounds, binBounds[b * 2]);
+            expandBounds(bounds, binBounds[b * 2 + 1]);
+            count += exits[b];
+            rightBounds[b * 2] = bounds[0];
+            rightBounds[b * 2 + 1] = bounds[1];
+            rightCount[b] = count;
+        }
+
+        bounds[0] = Vector3f(1e30, 1e30, 1e30);
+        bounds[1] = Vector3f(-1e30, -1e30, -1e30);
+        long int countLeft = 0;
+        for (int b = 0; b < numBins - 1; ++b)
         {
-            return current_node;
+            expandBounds(bounds, binBounds[b * 2]);
+            expandBounds(bounds, binBounds[b * 2 + 1]);
+            countLeft += entries[b];
+
+            long int countRight = rightCount[b + 1];
+            if (countLeft == 0 || countRight == 0)
+            {
+                continue;
+            }
+            double cost = surfaceArea(bounds) * countLeft + surfaceArea(&rightBounds[(b + 1) * 2]) * countRight;
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.position = aabb[0][axis] + (b + 1) / scale;
+                best.numLeft = countLeft;
+                best.numRight = countRight;
+            }
         }
     }
-    return current_node;
+    return best;
 }
 
-void Surface::UpdateAABB(BVH_Triangles *bvh)
+static double overlapArea(const Vector3f a[2], const Vector3f b[2])
 {
-    Vector3f max = Vector3f(-1e30, -1e30, -1e30);
-    Vector3f min = Vector3f(1e30, 1e30, 1e30);
-    for (int i = 0; i < bvh->Num_Of_Triangles; ++i)
+    Vector3f overlap[2];
+    for (int j = 0; j < 3; ++j)
     {
-        for (int j = 0; j < 3; ++j)
-        {
-            max[j] = bvh->vertices[i * 3 + j][j] > max[j] ? bvh->vertices[i * 3 + j][j] : max[j];
-            min[j] = bvh->vertices[i * 3 + j][j] < min[j] ? bvh->vertices[i * 3 + j][j] : min[j];
-        }
+        overlap[0][j] = std::max(a[0][j], b[0][j]);
+        overlap[1][j] = std::min(a[1][j], b[1][j]);
+    }
+    return surfaceArea(overlap);
+}
+
+// Build the subtree over the references refs (with their triangles in refTris)
+// and append its nodes depth-first. Leaves append their triangles to order,
+// so a triangle split by a spatial split appears in several leaves. budget is
+// the number of references the subtree may add by spatial splits.
+static uint32_t buildSBVHNode(std::vector<BVHNode> &nodes, std::vector<uint32_t> &order, const SBVHBuild &build,
+                              std::vector<BVHBuildTriangle> &refs, std::vector<uint32_t> &refTris,
+                              int depth, long int budget, int threads)
+{
+    const BVHSettings &settings = build.settings;
+    long int count = refs.size();
+
+    Vector3f aabb[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    Vector3f centroidBounds[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    for (const BVHBuildTriangle &ref : refs)
+    {
+        expandBounds(aabb, ref.aabb[0]);
+        expandBounds(aabb, ref.aabb[1]);
+        expandBounds(centroidBounds, ref.centroid);
     }
-    bvh->aabb[0] = min;
-    bvh->aabb[1] = max;
 
-    if (bvh->left != NULL)
+    uint32_t nodeIdx = nodes.size();
+    nodes.emplace_back();
+    storeBounds(nodes[nodeIdx], aabb);
+
+    // every reference goes left (side 0), right (1) or, clipped at the plane, to both children (2)
+    std::vector<uint8_t> side(count, 0);
+    int axis = 0;
+    double position = 0;
+    bool split = false;
+    std::vector<uint32_t> tris(count);
+    for (long int i = 0; i < count; ++i)
     {
-        this->UpdateAABB(bvh->left);
+        tris[i] = i;
     }
-    if (bvh->right != NULL)
+
+    // past half the traversal stack the balanced median split keeps the tree shallow enough
+    if (depth >= BVH_STACK_SIZE / 2 && count > settings.maxLeafSize)
     {
-        this->UpdateAABB(bvh->right);
+        long int numLeft;
+        splitMedian(refs, tris.data(), count, aabb, settings, numLeft, axis);
+        for (long int i = numLeft; i < count; ++i)
+        {
+            side[tris[i]] = 1;
+        }
+        split = true;
     }
+    else if (count > 1)
+    {
+        ObjectSplit object = findObjectSplit(refs, tris.data(), count, centroidBounds, settings, threads);
+
+        // spatial splits are only tried where the object split leaves the children overlapping
+        SpatialSplit spatial;
+        if (budget > 0 && (object.axis == -1 || overlapArea(object.left, object.right) > settings.spatialAlpha * build.rootArea))
+        {
+            spatial = findSpatialSplit(build, refs, refTris, aabb);
+            if (spatial.numLeft + spatial.numRight - count > budget)
+            {
+                spatial = SpatialSplit();
+            }
+        }
 
-    return;
+        // cost of a split: one traversal step plus the expected number of triangle tests
+        double splitCost = 1.0 + settings.leafCost * std::min(object.cost, spatial.cost) / surfaceArea(aabb);
+        bool leaf = settings.leafCost * count <= splitCost && count <= settings.maxLeafSize;
+
+        if (!leaf && spatial.axis != -1 && spatial.cost < object.cost)
+        {
+            axis = spatial.axis;
+            position = spatial.position;
+            long int numLeft = 0, numRight = 0;
+            for (long int i = 0; i < count; ++i)
+            {
+                side[i] = refs[i].aabb[1][axis] <= position ? 0 : refs[i].aabb[0][axis] >= position ? 1 : 2;
+                numLeft += side[i] != 1;
+                numRight += side[i] != 0;
+            }
+            // the bins only approximate the plane; take the object split if a side would be empty or hold everything
+            split = numLeft > 0 && numRight > 0 && numLeft < count && numRight < count;
+        }
+        if (!leaf && !split && object.axis != -1)
+        {
+            axis = object.axis;
+            for (long int i = 0; i < count; ++i)
+            {
+                side[i] = std::min(settings.bins - 1, int((refs[i].centroid[axis] - centroidBounds[0][axis]) * object.scale)) > object.bin;
+            }
+            split = true;
+        }
+        if (!split && count > settings.maxLeafSize)
+        {
+            // all centroids coincide: split the references in the middle
+            std::fill(side.begin() + count / 2, side.end(), 1);
+            split = true;
+        }
+    }
+
+    if (!split)
+    {
+        nodes[nodeIdx].offset = order.size();
+        nodes[nodeIdx].Num_Of_Triangles = count;
+        order.insert(order.end(), refTris.begin(), refTris.end());
+        return nodeIdx;
+    }
+
+    nodes[nodeIdx].axis = axis;
+
+    std::vector<BVHBuildTriangle> leftRefs, rightRefs;
+    std::vector<uint32_t> leftTris, rightTris;
+    for (long int i = 0; i < count; ++i)
+    {
+        if (side[i] != 2)
+        {
+            (side[i] == 0 ? leftRefs : rightRefs).push_back(refs[i]);
+            (side[i] == 0 ? leftTris : rightTris).push_back(refTris[i]);
+            continue;
+        }
+
+        // clip the straddling reference at the plane, but never lose the triangle to rounding
+        BVHBuildTriangle parts[2];
+        bool inLeft = clipTriangle(build, refTris[i], refs[i].aabb, axis, refs[i].aabb[0][axis], position, parts[0].aabb);
+        bool inRight = clipTriangle(build, refTris[i], refs[i].aabb, axis, position, refs[i].aabb[1][axis], parts[1].aabb);
+        if (!inLeft && !inRight)
+        {
+            parts[0] = refs[i];
+            inLeft = true;
+        }
+        if (inLeft)
+        {
+            parts[0].centroid = 0.5 * (parts[0].aabb[0] + parts[0].aabb[1]);
+            leftRefs.push_back(parts[0]);
+            leftTris.push_back(refTris[i]);
+        }
+        if (inRight)
+        {
+            parts[1].centroid = 0.5 * (parts[1].aabb[0] + parts[1].aabb[1]);
+            rightRefs.push_back(parts[1]);
+            rightTris.push_back(refTris[i]);
+        }
+    }
+
+    // what is left of the budget is shared in proportion to the size of the children,
+    // which keeps the tree independent of the thread count
+    long int remaining = std::max(0L, budget - long(leftRefs.size() + rightRefs.size() - count));
+    long int leftBudget = remaining * leftRefs.size() / (leftRefs.size() + rightRefs.size());
+    long int rightBudget = remaining - leftBudget;
+    std::vector<BVHBuildTriangle>().swap(refs);
+    std::vector<uint32_t>().swap(refTris);
+
+    // the left child directly follows its parent, the right child comes after the left subtree
+    uint32_t right;
+    if (threads > 1 && count >= BVH_PARALLEL_MIN_TRIANGLES)
+    {
+        std::vector<BVHNode> rightNodes;
+        std::vector<uint32_t> rightOrder;
+        int rightThreads = threads / 2;
+        std::thread rightBuild([&]()
+                               { buildSBVHNode(rightNodes, rightOrder, build, rightRefs, rightTris, depth + 1, rightBudget, rightThreads); });
+        buildSBVHNode(nodes, order, build, leftRefs, leftTris, depth + 1, leftBudget, threads - rightThreads);
+        rightBuild.join();
+
+        uint32_t leafShift = order.size();
+        order.insert(order.end(), rightOrder.begin(), rightOrder.end());
+        right = spliceNodes(nodes, rightNodes, leafShift);
+    }
+    else
+    {
+        buildSBVHNode(nodes, order, build, leftRefs, leftTris, depth + 1, leftBudget, 1);
+        right = buildSBVHNode(nodes, order, build, rightRefs, rightTris, depth + 1, rightBudget, 1);
+    }
+    nodes[nodeIdx].offset = right;
+
+    return nodeIdx;
+}
+
+// Build an SBVH over all triangles. order is rebuilt as the triangles of the
+// leaves in depth-first order and can be longer than the number of triangles.
+static void buildSBVH(std::vector<BVHNode> &nodes, const std::vector<BVHBuildTriangle> &buildTris, std::vector<uint32_t> &order,
+                      const std::vector<Vector3f> &vertices, const std::vector<Vector3i> &indices,
+                      const BVHSettings &settings, int threads)
+{
+    std::vector<BVHBuildTriangle> refs = buildTris;
+    std::vector<uint32_t> refTris = order;
+
+    Vector3f aabb[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    for (const BVHBuildTriangle &tri : buildTris)
+    {
+        expandBounds(aabb, tri.aabb[0]);
+        expandBounds(aabb, tri.aabb[1]);
+    }
+    SBVHBuild build = {vertices, indices, settings, surfaceArea(aabb)};
+
+    long int budget = long(settings.duplicationBudget * buildTris.size());
+    order.clear();
+    order.reserve(buildTris.size() + budget);
+    buildSBVHNode(nodes, order, build, refs, refTris, 0, budget, threads);
+    order.shrink_to_fit();
+}
+
+// SAH cost of a binary tree (one per traversal step, leafCost per triangle
+// test) relative to the area of its root
+static double treeCost(const std::vector<BVHNode> &nodes, float leafCost)
+{
+    auto area = [](const BVHNode &node)
+    {
+        double dx = node.aabb[1][0] - node.aabb[0][0];
+        double dy = node.aabb[1][1] - node.aabb[0][1];
+        double dz = node.aabb[1][2] - node.aabb[0][2];
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    };
+
+    double cost = 0;
+    for (const BVHNode &node : nodes)
+    {
+        cost += area(node) * (node.isLeaf() ? leafCost * node.Num_Of_Triangles : 1.0);
+    }
+    return nodes.empty() || area(nodes[0]) <= 0 ? 0.0 : cost / area(nodes[0]);
+}
+
+// Spread the low 21 bits of x so there are two zero bits between any two of them
+static uint64_t spreadBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Sort order by key with an LSD radix sort, 8 bits per pass. Every thread
+// histograms its chunk, the chunks get disjoint output ranges per digit and
+// scatter their keys there, which keeps every pass stable.
+static void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &order, int bits, int threads)
+{
+    long int count = keys.size();
+    int numChunks = count >= BVH_PARALLEL_MIN_TRIANGLES ? threads : 1;
+    std::vector<uint64_t> keysOut(count);
+    std::vector<uint32_t> orderOut(count);
+    std::vector<long int> offsets(numChunks * 256);
+
+    for (int shift = 0; shift < bits; shift += 8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallelChunks(count, numChunks, [&](int chunk, long int begin, long int end)
+                       {
+            long int *histogram = &offsets[chunk * 256];
+            for (long int i = begin; i < end; ++i)
+            {
+                histogram[(keys[i] >> shift) & 0xff]++;
+            } });
+
+        // digit-major prefix sum, so every chunk writes after the earlier chunks of the same digit
+        long int sum = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            for (int c = 0; c < numChunks; ++c)
+            {
+                long int n = offsets[c * 256 + digit];
+                offsets[c * 256 + digit] = sum;
+                sum += n;
+            }
+        }
+
+        parallelChunks(count, numChunks, [&](int chunk, long int begin, long int end)
+                       {
+            long int *next = &offsets[chunk * 256];
+            for (long int i = begin; i < end; ++i)
+            {
+                long int dst = next[(keys[i] >> shift) & 0xff]++;
+                keysOut[dst] = keys[i];
+                orderOut[dst] = order[i];
+            } });
+
+        keys.swap(keysOut);
+        order.swap(orderOut);
+    }
+}
+
+// Split axis of an interior node: the axis along which its child boxes are furthest apart
+static int separationAxis(const Vector3f left[2], const Vector3f right[2])
+{
+    Vector3f separation = (right[0] + right[1]) - (left[0] + left[1]);
+    int axis = 0;
+    for (int a = 1; a < 3; ++a)
+    {
+        if (std::abs(separation[a]) > std::abs(separation[axis]))
+        {
+            axis = a;
+        }
+    }
+    return axis;
+}
+
+struct LBVHBuild {
+    const std::vector<BVHBuildTriangle> &buildTris;
+    const std::vector<uint32_t> &order;
+    const std::vector<uint64_t> &codes; // Morton code of order[i], sorted
+    const BVHSettings &settings;
+};
+
+// Emit the subtree over the Morton-sorted triangles [first, first + count)
+// depth-first, like buildBVHNode. The range is split where the highest bit
+// that differs between its first and last code flips, so the hierarchy
+// follows the Morton curve without evaluating any split. Stores the bounds
+// of the subtree in aabb.
+static uint32_t emitLBVHNode(std::vector<BVHNode> &nodes, const LBVHBuild &build, uint32_t first, long int count,
+                             int depth, int threads, Vector3f aabb[2])
+{
+    uint32_t nodeIdx = nodes.size();
+    nodes.emplace_back();
+
+    long int numLeft = 0;
+    if (count > build.settings.maxLeafSize)
+    {
+        uint64_t diff = build.codes[first] ^ build.codes[first + count - 1];
+        // past half the traversal stack, and for equal codes, split in the middle
+        numLeft = count / 2;
+        if (diff != 0 && depth < BVH_STACK_SIZE / 2)
+        {
+            int bit = 0;
+            while (diff >>= 1)
+            {
+                bit++;
+            }
+            // every code in the range has the same bits above this one, so the ones with the bit set come last
+            auto begin = build.codes.begin() + first;
+            numLeft = std::partition_point(begin, begin + count, [bit](uint64_t code)
+                                           { return ((code >> bit) & 1) == 0; }) -
+                      begin;
+        }
+    }
+
+    if (numLeft == 0)
+    {
+        aabb[0] = Vector3f(1e30, 1e30, 1e30);
+        aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+        for (long int i = 0; i < count; ++i)
+        {
+            expandBounds(aabb, build.buildTris[build.order[first + i]].aabb[0]);
+            expandBounds(aabb, build.buildTris[build.order[first + i]].aabb[1]);
+        }
+        storeBounds(nodes[nodeIdx], aabb);
+        nodes[nodeIdx].offset = first;
+        nodes[nodeIdx].Num_Of_Triangles = count;
+        return nodeIdx;
+    }
+
+    // the node is indexed rather than referenced since the array grows
+    Vector3f leftBounds[2], rightBounds[2];
+    uint32_t right;
+    if (threads > 1 && count >= BVH_PARALLEL_MIN_TRIANGLES)
+    {
+        std::vector<BVHNode> rightNodes;
+        int rightThreads = threads / 2;
+        std::thread rightBuild([&]()
+                               { emitLBVHNode(rightNodes, build, first + numLeft, count - numLeft, depth + 1, rightThreads, rightBounds); });
+        emitLBVHNode(nodes, build, first, numLeft, depth + 1, threads - rightThreads, leftBounds);
+        rightBuild.join();
+        right = spliceNodes(nodes, rightNodes);
+    }
+    else
+    {
+        emitLBVHNode(nodes, build, first, numLeft, depth + 1, 1, leftBounds);
+        right = emitLBVHNode(nodes, build, first + numLeft, count - numLeft, depth + 1, 1, rightBounds);
+    }
+    nodes[nodeIdx].offset = right;
+
+    aabb[0] = leftBounds[0];
+    aabb[1] = leftBounds[1];
+    expandBounds(aabb, rightBounds[0]);
+    expandBounds(aabb, rightBounds[1]);
+    storeBounds(nodes[nodeIdx], aabb);
+    nodes[nodeIdx].axis = separationAxis(leftBounds, rightBounds);
+    return nodeIdx;
+}
+
+// Node of a binary BVH while its treelets are restructured. Children are
+// indices into the same array, so treelets can be rearranged in place.
+struct TreeletNode {
+    Vector3f aabb[2];
+    uint32_t child[2];
+    uint32_t first;   // leaf: first face
+    long int count;   // leaf: number of triangles, 0 for interior nodes
+    long int size;    // number of triangles in the subtree
+    double cost;      // SAH cost of the subtree, not divided by any area
+    int height;       // 0 for leaves
+};
+
+// Optimal topology of a treelet: for every subset of its leaves, the bounds,
+// the lowest SAH cost of a subtree over them and the subset of its left child
+struct Treelet {
+    uint32_t leaves[8];
+    int numLeaves;
+    Vector3f bounds[256][2];
+    double cost[256];
+    int split[256];
+};
+
+// Rebuild the subtree over the leaf subset set below target, taking interior
+// nodes from internals. Returns the height of the subtree.
+static int assignTreelet(std::vector<TreeletNode> &nodes, const Treelet &treelet, int set, uint32_t target,
+                         const uint32_t *internals, int &nextInternal)
+{
+    TreeletNode &node = nodes[target];
+    int sets[2] = {treelet.split[set], set ^ treelet.split[set]};
+    int height = 0;
+    node.size = 0;
+    for (int k = 0; k < 2; ++k)
+    {
+        // single leaves keep their node, larger subsets take the next interior node
+        int bit = 0;
+        while (!((sets[k] >> bit) & 1))
+        {
+            bit++;
+        }
+        if (sets[k] == 1 << bit)
+        {
+            node.child[k] = treelet.leaves[bit];
+            height = std::max(height, nodes[node.child[k]].height);
+        }
+        else
+        {
+            node.child[k] = internals[nextInternal++];
+            height = std::max(height, assignTreelet(nodes, treelet, sets[k], node.child[k], internals, nextInternal));
+        }
+        node.size += nodes[node.child[k]].size;
+    }
+    node.aabb[0] = treelet.bounds[set][0];
+    node.aabb[1] = treelet.bounds[set][1];
+    node.cost = treelet.cost[set];
+    node.count = 0;
+    node.height = height + 1;
+    return node.height;
+}
+
+static void updateHeight(std::vector<TreeletNode> &nodes, uint32_t nodeIdx)
+{
+    TreeletNode &node = nodes[nodeIdx];
+    node.height = 1 + std::max(nodes[node.child[0]].height, nodes[node.child[1]].height);
+}
+
+// Reorganise the treelet below an interior node into the topology with the
+// lowest SAH cost. The treelet grows by opening its largest interior leaf.
+static void restructureTreelet(std::vector<TreeletNode> &nodes, uint32_t root, const BVHSettings &settings)
+{
+    // the children may have been restructured into deeper subtrees since the height was set
+    updateHeight(nodes, root);
+
+    Treelet treelet;
+    uint32_t internals[8];
+    int numInternals = 0;
+    internals[numInternals++] = root;
+    treelet.leaves[0] = nodes[root].child[0];
+    treelet.leaves[1] = nodes[root].child[1];
+    treelet.numLeaves = 2;
+
+    while (treelet.numLeaves < settings.treeletSize)
+    {
+        int best = -1;
+        double bestArea = -1.0;
+        for (int k = 0; k < treelet.numLeaves; ++k)
+        {
+            const TreeletNode &leaf = nodes[treelet.leaves[k]];
+            if (leaf.count == 0 && surfaceArea(leaf.aabb) > bestArea)
+            {
+                best = k;
+                bestArea = surfaceArea(leaf.aabb);
+            }
+        }
+        if (best == -1)
+        {
+            break;
+        }
+        uint32_t opened = treelet.leaves[best];
+        internals[numInternals++] = opened;
+        treelet.leaves[best] = nodes[opened].child[0];
+        treelet.leaves[treelet.numLeaves++] = nodes[opened].child[1];
+    }
+    if (treelet.numLeaves < 3)
+    {
+        return;
+    }
+
+    // subsets are visited in increasing order, so all their proper subsets are done
+    int full = (1 << treelet.numLeaves) - 1;
+    for (int set = 1; set <= full; ++set)
+    {
+        int lowest = set & -set;
+        int bit = 0;
+        while (lowest >> bit != 1)
+        {
+            bit++;
+        }
+        const TreeletNode &leaf = nodes[treelet.leaves[bit]];
+        if (set == lowest)
+        {
+            treelet.bounds[set][0] = leaf.aabb[0];
+            treelet.bounds[set][1] = leaf.aabb[1];
+            treelet.cost[set] = leaf.cost;
+            continue;
+        }
+        treelet.bounds[set][0] = treelet.bounds[set ^ lowest][0];
+        treelet.bounds[set][1] = treelet.bounds[set ^ lowest][1];
+        expandBounds(treelet.bounds[set], leaf.aabb[0]);
+        expandBounds(treelet.bounds[set], leaf.aabb[1]);
+
+        // every split into two halves once: the lowest leaf is always on the left
+        double best = 1e300;
+        for (int left = (set - 1) & set; left > 0; left = (left - 1) & set)
+        {
+            if ((left & lowest) && treelet.cost[left] + treelet.cost[set ^ left] < best)
+            {
+                best = treelet.cost[left] + treelet.cost[set ^ left];
+                treelet.split[set] = left;
+            }
+        }
+        treelet.cost[set] = surfaceArea(treelet.bounds[set]) + best;
+    }
+
+    if (treelet.cost[full] >= nodes[root].cost)
+    {
+        return;
+    }
+
+    // a cheaper treelet can be deeper; keep the old one if it would outgrow the traversal stack
+    TreeletNode saved[8];
+    for (int k = 0; k < numInternals; ++k)
+    {
+        saved[k] = nodes[internals[k]];
+    }
+    int nextInternal = 1;
+    if (assignTreelet(nodes, treelet, full, root, internals, nextInternal) >= BVH_STACK_SIZE - 1)
+    {
+        for (int k = 0; k < numInternals; ++k)
+        {
+            nodes[internals[k]] = saved[k];
+        }
+        updateHeight(nodes, root);
+    }
+}
+
+// Restructure the treelets of a subtree bottom-up, so every treelet is built
+// from already optimised subtrees. Large subtrees are handled on their own thread.
+static void restructureTreelets(std::vector<TreeletNode> &nodes, uint32_t nodeIdx, const BVHSettings &settings, int threads)
+{
+    TreeletNode &node = nodes[nodeIdx];
+    if (node.count > 0)
+    {
+        return;
+    }
+
+    if (threads > 1 && node.size >= BVH_PARALLEL_MIN_TRIANGLES)
+    {
+        int rightThreads = threads / 2;
+        std::thread rightPass([&]()
+                              { restructureTreelets(nodes, node.child[1], settings, rightThreads); });
+        restructureTreelets(nodes, node.child[0], settings, threads - rightThreads);
+        rightPass.join();
+    }
+    else
+    {
+        restructureTreelets(nodes, node.child[0], settings, 1);
+        restructureTreelets(nodes, node.child[1], settings, 1);
+    }
+
+    restructureTreelet(nodes, nodeIdx, settings);
+}
+
+// Flatten the restructured tree depth-first into the layout the traversals use
+static void flattenTreelets(const std::vector<TreeletNode> &treeletNodes, uint32_t treeletIdx, std::vector<BVHNode> &nodes)
+{
+    const TreeletNode &node = treeletNodes[treeletIdx];
+    uint32_t nodeIdx = nodes.size();
+    nodes.emplace_back();
+    storeBounds(nodes[nodeIdx], node.aabb);
+
+    if (node.count > 0)
+    {
+        nodes[nodeIdx].offset = node.first;
+        nodes[nodeIdx].Num_Of_Triangles = node.count;
+        return;
+    }
+
+    nodes[nodeIdx].axis = separationAxis(treeletNodes[node.child[0]].aabb, treeletNodes[node.child[1]].aabb);
+    flattenTreelets(treeletNodes, node.child[0], nodes);
+    uint32_t right = nodes.size();
+    nodes[nodeIdx].offset = right;
+    flattenTreelets(treeletNodes, node.child[1], nodes);
+}
+
+// Treelet restructuring (Karras and Aila 2013): every treelet of up to
+// settings.treeletSize leaves is replaced by the topology with the lowest SAH
+// cost, which recovers most of the quality the Morton order gives away
+static void restructureBVH(std::vector<BVHNode> &nodes, const BVHSettings &settings, int threads)
+{
+    // children come after their parent, so a reverse pass sees them first
+    std::vector<TreeletNode> treeletNodes(nodes.size());
+    for (long int i = nodes.size() - 1; i >= 0; --i)
+    {
+        const BVHNode &node = nodes[i];
+        TreeletNode &treeletNode = treeletNodes[i];
+        for (int a = 0; a < 3; ++a)
+        {
+            treeletNode.aabb[0][a] = node.aabb[0][a];
+            treeletNode.aabb[1][a] = node.aabb[1][a];
+        }
+        if (node.isLeaf())
+        {
+            treeletNode.first = node.offset;
+            treeletNode.count = treeletNode.size = node.Num_Of_Triangles;
+            treeletNode.cost = surfaceArea(treeletNode.aabb) * settings.leafCost * node.Num_Of_Triangles;
+            treeletNode.height = 0;
+            continue;
+        }
+        const TreeletNode &left = treeletNodes[i + 1];
+        const TreeletNode &right = treeletNodes[node.offset];
+        treeletNode.child[0] = i + 1;
+        treeletNode.child[1] = node.offset;
+        treeletNode.count = 0;
+        treeletNode.size = left.size + right.size;
+        treeletNode.cost = surfaceArea(treeletNode.aabb) + left.cost + right.cost;
+        treeletNode.height = 1 + std::max(left.height, right.height);
+    }
+
+    restructureTreelets(treeletNodes, 0, settings, threads);
+
+    nodes.clear();
+    flattenTreelets(treeletNodes, 0, nodes);
+}
+
+// Linear BVH: sort the triangles by the Morton code of their centroid and emit
+// the hierarchy from the sorted codes, optionally followed by treelet restructuring
+static void buildLBVH(std::vector<BVHNode> &nodes, const std::vector<BVHBuildTriangle> &buildTris,
+                      std::vector<uint32_t> &order, const BVHSettings &settings, int threads)
+{
+    long int count = order.size();
+    int numChunks = count >= BVH_PARALLEL_MIN_TRIANGLES ? threads : 1;
+
+    std::vector<Vector3f> chunkBounds(numChunks * 2);
+    parallelChunks(count, numChunks, [&](int chunk, long int begin, long int end)
+                   {
+        chunkBounds[chunk * 2] = Vector3f(1e30, 1e30, 1e30);
+        chunkBounds[chunk * 2 + 1] = Vector3f(-1e30, -1e30, -1e30);
+        for (long int i = begin; i < end; ++i)
+        {
+            expandBounds(&chunkBounds[chunk * 2], buildTris[i].centroid);
+        } });
+    Vector3f centroidBounds[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+    for (int c = 0; c < numChunks; ++c)
+    {
+        if (count * (c + 1) / numChunks > count * c / numChunks)
+        {
+            expandBounds(centroidBounds, chunkBounds[c * 2]);
+            expandBounds(centroidBounds, chunkBounds[c * 2 + 1]);
+        }
+    }
+
+    // quantise every centroid to a grid of 2^(bits / 3) cells per axis
+    int axisBits = settings.mortonBits / 3;
+    double cells = double(1 << axisBits);
+    Vector3f extent = centroidBounds[1] - centroidBounds[0];
+    std::vector<uint64_t> codes(count);
+    parallelChunks(count, numChunks, [&](int, long int begin, long int end)
+                   {
+        for (long int i = begin; i < end; ++i)
+        {
+            uint64_t code = 0;
+            for (int a = 0; a < 3; ++a)
+            {
+                double u = extent[a] > 0 ? (buildTris[order[i]].centroid[a] - centroidBounds[0][a]) / extent[a] : 0.0;
+                uint64_t cell = std::min(uint64_t(u * cells), uint64_t(cells) - 1);
+                code |= spreadBits(cell) << (2 - a);
+            }
+            codes[i] = code;
+        } });
+    radixSort(codes, order, settings.mortonBits, threads);
+
+    LBVHBuild build = {buildTris, order, codes, settings};
+    Vector3f aabb[2];
+    nodes.reserve(count);
+    emitLBVHNode(nodes, build, 0, count, 0, threads, aabb);
+    if (settings.treeletSize > 0)
+    {
+        restructureBVH(nodes, settings, threads);
+    }
+    nodes.shrink_to_fit();
+}
+
+void Surface::PopulateBVH(const BVHSettings &settings)
+{
+    auto buildStart = std::chrono::high_resolution_clock::now();
+
+    // a rebuild starts from every face once, without the copies of an earlier spatial split build
+    if (this->bvh.duplicates > 0)
+    {
+        std::sort(this->indices.begin(), this->indices.end(), [](const Vector3i &a, const Vector3i &b)
+                  { return std::make_tuple(a.x, a.y, a.z) < std::make_tuple(b.x, b.y, b.z); });
+        this->indices.erase(std::unique(this->indices.begin(), this->indices.end(), [](const Vector3i &a, const Vector3i &b)
+                                        { return a.x == b.x && a.y == b.y && a.z == b.z; }),
+                            this->indices.end());
+        this->bvh.duplicates = 0;
+    }
+
+    long int numTriangles = this->indices.size();
+    int threads = settings.threads > 0 ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<BVHBuildTriangle> buildTris(numTriangles);
+    parallelChunks(numTriangles, numTriangles >= BVH_PARALLEL_MIN_TRIANGLES ? threads : 1, [&](int, long int begin, long int end)
+                   {
+        for (long int i = begin; i < end; ++i)
+        {
+            const Vector3i &face = this->indices[i];
+            BVHBuildTriangle &tri = buildTris[i];
+
+            tri.aabb[0] = Vector3f(1e30, 1e30, 1e30);
+            tri.aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+            expandBounds(tri.aabb, this->vertices[face.x]);
+            expandBounds(tri.aabb, this->vertices[face.y]);
+            expandBounds(tri.aabb, this->vertices[face.z]);
+            tri.centroid = (1.0 / 3.0) * (this->vertices[face.x] + this->vertices[face.y] + this->vertices[face.z]);
+        } });
+
+    this->bvh.nodes.clear();
+    if (numTriangles == 0)
+    {
+        return;
+    }
+
+    std::vector<uint32_t> order(numTriangles);
+    for (long int i = 0; i < numTriangles; ++i)
+    {
+        order[i] = i;
+    }
+
+    if (settings.builder == BVH_LBVH)
+    {
+        buildLBVH(this->bvh.nodes, buildTris, order, settings, threads);
+    }
+    else if (settings.builder == BVH_SBVH)
+    {
+        buildSBVH(this->bvh.nodes, buildTris, order, this->vertices, this->indices, settings, threads);
+    }
+    else
+    {
+        // a binary tree over n leaves has 2n - 1 nodes
+        this->bvh.nodes.reserve(2 * numTriangles - 1);
+        buildBVHNode(this->bvh.nodes, buildTris, order, 0, numTriangles, settings, 0, threads);
+        this->bvh.nodes.shrink_to_fit();
+    }
+    this->bvh.settings = settings;
+    this->bvh.sahCost = this->bvh.refitSahCost = treeCost(this->bvh.nodes, settings.leafCost);
+    this->bvh.refits = 0;
+
+    // store the faces in BVH order so every leaf references a range of indices;
+    // faces that spatial splits put in several leaves are stored once per leaf
+    this->bvh.duplicates = order.size() - numTriangles;
+    std::vector<Vector3i> permuted(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        permuted[i] = this->indices[order[i]];
+    }
+    this->indices.swap(permuted);
+
+    this->bvh.width = settings.width;
+    this->bvh.quantized = settings.quantized;
+    this->buildTraversalData();
+
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    this->bvh.buildMs = std::chrono::duration<double, std::milli>(buildEnd - buildStart).count();
+}
+
+void Surface::buildTraversalData()
+{
+    this->collapseBVH();
+    this->triangles.build(this->vertices, this->normals, this->indices);
+}
+
+void Surface::collapseBVH()
+{
+    // quantizing moves the leaves within indices, the triangle records are built afterwards
+    if (this->bvh.width == 4 && this->bvh.quantized)
+    {
+        quantizeBVH(this->bvh.nodes, this->indices, this->bvh.quantized4);
+    }
+    else if (this->bvh.width == 8 && this->bvh.quantized)
+    {
+        quantizeBVH(this->bvh.nodes, this->indices, this->bvh.quantized8);
+    }
+    else if (this->bvh.width == 4)
+    {
+        ::collapseBVH(this->bvh.nodes, this->bvh.nodes4);
+    }
+    else if (this->bvh.width == 8)
+    {
+        ::collapseBVH(this->bvh.nodes, this->bvh.nodes8);
+    }
+}
+
+GeometryMemory Surface::memoryUsage() const
+{
+    GeometryMemory mem;
+    mem.triangles = this->indices.size();
+
+    mem.bytes = this->vertices.size() * sizeof(Vector3f) + this->normals.size() * sizeof(Vector3f) +
+                this->uvs.size() * sizeof(Vector2f) + this->indices.size() * sizeof(Vector3i) +
+                this->bvh.nodes.size() * sizeof(BVHNode) + this->bvh.nodes4.size() * sizeof(WideBVHNode<4>) +
+                this->bvh.nodes8.size() * sizeof(WideBVHNode<8>) + this->bvh.quantized4.size() * sizeof(QuantizedBVHNode<4>) +
+                this->bvh.quantized8.size() * sizeof(QuantizedBVHNode<8>) + this->triangles.bytes();
+
+    if (this->bvh.width == 2)
+        mem.nodeBytes = this->bvh.nodes.size() * sizeof(BVHNode);
+    else if (this->bvh.quantized)
+        mem.nodeBytes = this->bvh.quantized4.size() * sizeof(QuantizedBVHNode<4>) + this->bvh.quantized8.size() * sizeof(QuantizedBVHNode<8>);
+    else
+        mem.nodeBytes = this->bvh.nodes4.size() * sizeof(WideBVHNode<4>) + this->bvh.nodes8.size() * sizeof(WideBVHNode<8>);
+
+    // The pointer based BVH this replaced kept three vertices, normals and uvs
+    // per triangle in the surface, a copy of all vertices and normals in the
+    // root and another copy in every node below it. Estimate that layout for
+    // the same tree by counting the triangles below every node.
+    const size_t legacyNodeSize = 2 * sizeof(void *) + 2 * sizeof(std::vector<Vector3f>) + sizeof(long int) + 2 * sizeof(Vector3f);
+    const size_t legacyTriangleSize = 6 * sizeof(Vector3f);
+
+    mem.legacyBytes = mem.triangles * (3 * sizeof(Vector3f) + 3 * sizeof(Vector3f) + 3 * sizeof(Vector2f) + sizeof(Vector3i));
+    std::vector<size_t> below(this->bvh.nodes.size());
+    for (long int i = long(this->bvh.nodes.size()) - 1; i >= 0; --i)
+    {
+        const BVHNode &node = this->bvh.nodes[i];
+        below[i] = node.isLeaf() ? node.Num_Of_Triangles : below[i + 1] + below[node.offset];
+        mem.legacyBytes += legacyNodeSize + below[i] * legacyTriangleSize;
+    }
+
+    return mem;
+}
+
+void Surface::PrintBVH(uint32_t node, int lvl)
+{
+    const BVHNode &cur = this->bvh.nodes[node];
+    for (int i = 0; i < lvl; ++i)
+    {
+        printf("  ");
+    }
+    for (int i = 0; i < cur.Num_Of_Triangles; ++i)
+    {
+        printf("%u ", cur.offset + i);
+    }
+    printf("\n");
+    if (!cur.isLeaf())
+    {
+        this->PrintBVH(node + 1, lvl + 1);
+        this->PrintBVH(cur.offset, lvl + 1);
+    }
+}
+
+Interaction Surface::Traverse_BVH(Ray &ray)
+{
+    if (this->bvh.width == 4)
+    {
+        return this->bvh.quantized ? this->Traverse_WideBVH<4>(ray, this->bvh.quantized4) : this->Traverse_WideBVH<4>(ray, this->bvh.nodes4);
+    }
+    if (this->bvh.width == 8)
+    {
+        return this->bvh.quantized ? this->Traverse_WideBVH<8>(ray, this->bvh.quantized8) : this->Traverse_WideBVH<8>(ray, this->bvh.nodes8);
+    }
+    return this->Traverse_BinaryBVH(ray, 0);
+}
+
+Interaction Surface::Traverse_BinaryBVH(Ray &ray, uint32_t root)
+{
+    Interaction siFinal;
+    float tEntry;
+
+    ray_stats.nodeTests++;
+    if (this->bvh.nodes.empty() || !this->bvh.nodes[root].slab_test(ray, tEntry))
+    {
+        return siFinal;
+    }
+
+    // nodes still to visit, with the distance at which the ray enters them
+    uint32_t stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current_node = root;
+
+    while (true)
+    {
+        const BVHNode &node = this->bvh.nodes[current_node];
+        if (node.isLeaf())
+        {
+            Interaction si = this->rayIntersectLeaf(ray, node.offset, node.offset + node.Num_Of_Triangles);
+            if (si.didIntersect)
+            {
+                siFinal = si;
+            }
+        }
+        else
+        {
+            uint32_t left = current_node + 1;
+            uint32_t right = node.offset;
+            float tLeft, tRight;
+            bool hitLeft = this->bvh.nodes[left].slab_test(ray, tLeft);
+            bool hitRight = this->bvh.nodes[right].slab_test(ray, tRight);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft && hitRight)
+            {
+                // visit the nearer child first and come back for the other one
+                if (tRight < tLeft)
+                {
+                    std::swap(left, right);
+                    std::swap(tLeft, tRight);
+                }
+                stack[stackSize] = right;
+                stackEntry[stackSize] = tRight;
+                stackSize++;
+                current_node = left;
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current_node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        // next node on the stack that the ray enters before the closest hit
+        do
+        {
+            if (stackSize == 0)
+            {
+                return siFinal;
+            }
+            stackSize--;
+        } while (stackEntry[stackSize] > ray.t);
+        current_node = stack[stackSize];
+    }
+}
+
+template <int N, typename Node>
+Interaction Surface::Traverse_WideBVH(Ray &ray, const std::vector<Node> &nodes)
+{
+    Interaction siFinal;
+    if (nodes.empty())
+    {
+        return siFinal;
+    }
+
+    WideBVHRay wideRay(ray);
+
+    // children still to visit; every node pushes at most N - 1 more than it pops
+    struct StackEntry {
+        uint32_t child;
+        uint32_t Num_Of_Triangles;
+        float tEntry;
+    } stack[BVH_STACK_SIZE * N];
+    int stackSize = 0;
+    uint32_t current_node = 0;
+
+    while (true)
+    {
+        const Node &node = nodes[current_node];
+        float tEntry[N];
+        int mask = slabTestWide(node, wideRay, ray.t, tEntry);
+        ray_stats.nodeTests++;
+
+        // push the children that were hit, farthest first so the nearest is popped first
+        uint32_t child[N], count[N];
+        wideChildren(node, child, count);
+        int first = stackSize;
+        for (int k = 0; k < N; ++k)
+        {
+            if (mask & (1 << k))
+            {
+                StackEntry entry = {child[k], count[k], tEntry[k]};
+                int i = stackSize++;
+                while (i > first && stack[i - 1].tEntry < entry.tEntry)
+                {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+                stack[i] = entry;
+            }
+        }
+
+        // intersect leaves until the next interior node that the ray enters before the closest hit
+        while (true)
+        {
+            if (stackSize == 0)
+            {
+                return siFinal;
+            }
+            StackEntry entry = stack[--stackSize];
+            if (entry.tEntry > ray.t)
+            {
+                continue;
+            }
+            if (entry.Num_Of_Triangles == 0)
+            {
+                current_node = entry.child;
+                break;
+            }
+            Interaction si = this->rayIntersectLeaf(ray, entry.child, entry.child + entry.Num_Of_Triangles);
+            if (si.didIntersect)
+            {
+                siFinal = si;
+            }
+        }
+    }
+}
+
+template <int N>
+void Surface::Traverse_BVHPacket(Ray rays[], RayPacket<N> &packet, int active, Interaction si[])
+{
+    // the wide layouts already test all children of a node at once, so their rays go one by one
+    if (this->bvh.width != 2)
+    {
+        for (int k = 0; k < N; ++k)
+        {
+            if (active & (1 << k))
+            {
+                Interaction s = this->Traverse_BVH(rays[k]);
+                if (s.didIntersect)
+                {
+                    si[k] = s;
+                    packet.t[k] = rays[k].t;
+                }
+            }
+        }
+        return;
+    }
+
+    float tEntry[N];
+    ray_stats.nodeTests++;
+    if (this->bvh.nodes.empty() || !(active = slabTestPacket<N>(this->bvh.nodes[0].aabb[0], this->bvh.nodes[0].aabb[1], packet, active, tEntry)))
+    {
+        return;
+    }
+
+    // nodes still to visit, with the rays that enter them and where
+    struct StackEntry {
+        uint32_t node;
+        int active;
+        float tEntry[N];
+    } stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current_node = 0;
+
+    while (true)
+    {
+        const BVHNode &node = this->bvh.nodes[current_node];
+        if (packetDiverged<N>(active))
+        {
+            // too few rays left to fill the SIMD lanes: finish this subtree one ray at a time
+            for (int k = 0; k < N; ++k)
+            {
+                if (active & (1 << k))
+                {
+                    Interaction s = this->Traverse_BinaryBVH(rays[k], current_node);
+                    if (s.didIntersect)
+                    {
+                        si[k] = s;
+                        packet.t[k] = rays[k].t;
+                    }
+                }
+            }
+        }
+        else if (node.isLeaf())
+        {
+            for (int k = 0; k < N; ++k)
+            {
+                if (active & (1 << k))
+                {
+                    Interaction s = this->rayIntersectLeaf(rays[k], node.offset, node.offset + node.Num_Of_Triangles);
+                    if (s.didIntersect)
+                    {
+                        si[k] = s;
+                        packet.t[k] = rays[k].t;
+                    }
+                }
+            }
+        }
+        else
+        {
+            uint32_t left = current_node + 1;
+            uint32_t right = node.offset;
+            StackEntry hitLeft, hitRight;
+            hitLeft.node = left;
+            hitLeft.active = slabTestPacket<N>(this->bvh.nodes[left].aabb[0], this->bvh.nodes[left].aabb[1], packet, active, hitLeft.tEntry);
+            hitRight.node = right;
+            hitRight.active = slabTestPacket<N>(this->bvh.nodes[right].aabb[0], this->bvh.nodes[right].aabb[1], packet, active, hitRight.tEntry);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft.active && hitRight.active)
+            {
+                // visit the child that the first ray entering both enters first
+                int both = hitLeft.active & hitRight.active;
+                if (both && hitRight.tEntry[firstRay(both)] < hitLeft.tEntry[firstRay(both)])
+                {
+                    std::swap(hitLeft, hitRight);
+                }
+                stack[stackSize++] = hitRight;
+                current_node = hitLeft.node;
+                active = hitLeft.active;
+                continue;
+            }
+            if (hitLeft.active || hitRight.active)
+            {
+                current_node = hitLeft.active ? left : right;
+                active = hitLeft.active | hitRight.active;
+                continue;
+            }
+        }
+
+        // next node on the stack that a ray enters before its closest hit
+        do
+        {
+            if (stackSize == 0)
+            {
+                return;
+            }
+            const StackEntry &entry = stack[--stackSize];
+            active = 0;
+            for (int k = 0; k < N; ++k)
+            {
+                active |= ((entry.active >> k) & 1 && entry.tEntry[k] <= packet.t[k]) << k;
+            }
+            current_node = entry.node;
+        } while (!active);
+    }
+}
+
+template void Surface::Traverse_BVHPacket<4>(Ray rays[], RayPacket<4> &packet, int active, Interaction si[]);
+template void Surface::Traverse_BVHPacket<8>(Ray rays[], RayPacket<8> &packet, int active, Interaction si[]);
+template void Surface::Traverse_BVHPacket<16>(Ray rays[], RayPacket<16> &packet, int active, Interaction si[]);
+
+bool Surface::occludedBVH(const Ray &ray)
+{
+    float tEntry;
+
+    ray_stats.nodeTests++;
+    if (this->bvh.nodes.empty() || !this->bvh.nodes[0].slab_test(ray, tEntry))
+    {
+        return false;
+    }
+
+    // any hit will do, so the nodes are visited in no particular order
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current_node = 0;
+
+    while (true)
+    {
+        const BVHNode &node = this->bvh.nodes[current_node];
+        if (node.isLeaf())
+        {
+            if (this->occludedLeaf(ray, node.offset, node.offset + node.Num_Of_Triangles))
+            {
+                return true;
+            }
+        }
+        else
+        {
+            uint32_t left = current_node + 1;
+            uint32_t right = node.offset;
+            float tLeft, tRight;
+            bool hitLeft = this->bvh.nodes[left].slab_test(ray, tLeft);
+            bool hitRight = this->bvh.nodes[right].slab_test(ray, tRight);
+            ray_stats.nodeTests += 2;
+
+            if (hitLeft && hitRight)
+            {
+                stack[stackSize++] = right;
+                current_node = left;
+                continue;
+            }
+            if (hitLeft || hitRight)
+            {
+                current_node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+        {
+            return false;
+        }
+        current_node = stack[--stackSize];
+    }
+}
+
+template <int N, typename Node>
+bool Surface::occludedWideBVH(const Ray &ray, const std::vector<Node> &nodes)
+{
+    if (nodes.empty())
+    {
+        return false;
+    }
+
+    WideBVHRay wideRay(ray);
+
+    // interior children still to visit; leaves are tested as soon as they are found
+    uint32_t stack[BVH_STACK_SIZE * N];
+    int stackSize = 0;
+    uint32_t current_node = 0;
+
+    while (true)
+    {
+        const Node &node = nodes[current_node];
+        float tEntry[N];
+        int mask = slabTestWide(node, wideRay, ray.t, tEntry);
+        ray_stats.nodeTests++;
+
+        uint32_t child[N], count[N];
+        wideChildren(node, child, count);
+        for (int k = 0; k < N; ++k)
+        {
+            if (!(mask & (1 << k)))
+            {
+                continue;
+            }
+            if (count[k] == 0)
+            {
+                stack[stackSize++] = child[k];
+                continue;
+            }
+            if (this->occludedLeaf(ray, child[k], child[k] + count[k]))
+            {
+                return true;
+            }
+        }
+
+        if (stackSize == 0)
+        {
+            return false;
+        }
+        current_node = stack[--stackSize];
+    }
+}
+
+// Refit the binary nodes [first, end), which hold one whole subtree, to the
+// current vertices. The right subtree of a large node is refit on its own thread.
+static void refitNodes(std::vector<BVHNode> &nodes, const std::vector<Vector3i> &indices, const std::vector<Vector3f> &vertices,
+                       uint32_t first, uint32_t end, int threads)
+{
+    uint32_t last = first;
+    if (threads > 1 && end - first >= BVH_PARALLEL_MIN_TRIANGLES && !nodes[first].isLeaf())
+    {
+        uint32_t right = nodes[first].offset;
+        int rightThreads = threads / 2;
+        std::thread rightRefit([&]()
+                               { refitNodes(nodes, indices, vertices, right, end, rightThreads); });
+        refitNodes(nodes, indices, vertices, first + 1, right, threads - rightThreads);
+        rightRefit.join();
+    }
+    else
+    {
+        last = end - 1;
+    }
+
+    // children are stored after their parent, so a reverse sweep visits them first
+    for (long int i = last; i >= long(first); --i)
+    {
+        BVHNode &node = nodes[i];
+        Vector3f aabb[2] = {Vector3f(1e30, 1e30, 1e30), Vector3f(-1e30, -1e30, -1e30)};
+
+        if (node.isLeaf())
+        {
+            for (int k = 0; k < node.Num_Of_Triangles; ++k)
+            {
+                const Vector3i &face = indices[node.offset + k];
+                expandBounds(aabb, vertices[face.x]);
+                expandBounds(aabb, vertices[face.y]);
+                expandBounds(aabb, vertices[face.z]);
+            }
+        }
+        else
+        {
+            for (const BVHNode *child : {&nodes[i + 1], &nodes[node.offset]})
+            {
+                expandBounds(aabb, Vector3f(child->aabb[0][0], child->aabb[0][1], child->aabb[0][2]));
+                expandBounds(aabb, Vector3f(child->aabb[1][0], child->aabb[1][1], child->aabb[1][2]));
+            }
+        }
+        storeBounds(node, aabb);
+    }
+}
+
+void Surface::UpdateAABB()
+{
+    this->aabb[0] = Vector3f(1e30, 1e30, 1e30);
+    this->aabb[1] = Vector3f(-1e30, -1e30, -1e30);
+    for (const Vector3f &vertex : this->vertices)
+    {
+        expandBounds(this->aabb, vertex);
+    }
+    if (this->bvh.nodes.empty())
+    {
+        return;
+    }
+
+    // the topology stays, only the boxes follow the vertices; triangles split
+    // by an SBVH get the box of the whole triangle, which is still conservative
+    int threads = this->bvh.settings.threads > 0 ? this->bvh.settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    refitNodes(this->bvh.nodes, this->indices, this->vertices, 0, this->bvh.nodes.size(), threads);
+    this->bvh.refitSahCost = treeCost(this->bvh.nodes, this->bvh.settings.leafCost);
+    this->bvh.refits++;
+}
+
+void Surface::translate(const Vector3f &offset)
+{
+    this->aabb[0] += offset;
+    this->aabb[1] += offset;
+
+    // an instance only moves its placement, the mesh stays in object space
+    if (this->mesh != NULL)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            this->toWorld.m[i][3] += offset[i];
+        }
+        this->toObject = this->toWorld.inverse();
+        return;
+    }
+
+    for (Vector3f &vertex : this->vertices)
+    {
+        vertex += offset;
+    }
+    // the records are relative to their origin, so they stay as they are
+    this->triangles.origin += offset;
+
+    // shifting the boxes in double and rounding them outwards keeps them around the shifted vertices,
+    // including the clipped boxes of an SBVH; the topology and its SAH cost do not change
+    for (BVHNode &node : this->bvh.nodes)
+    {
+        Vector3f aabb[2] = {Vector3f(node.aabb[0][0], node.aabb[0][1], node.aabb[0][2]) + offset,
+                            Vector3f(node.aabb[1][0], node.aabb[1][1], node.aabb[1][2]) + offset};
+        storeBounds(node, aabb);
+    }
+
+    // quantizing orders the faces by the wide nodes, which only regroup if rounding tips a tie
+    // between the areas that decide them; the records then have to follow the new order
+    std::vector<Vector3i> order;
+    if (this->bvh.quantized)
+    {
+        order = this->indices;
+    }
+    this->collapseBVH();
+    if (this->bvh.quantized && order != this->indices)
+    {
+        this->triangles.build(this->vertices, this->normals, this->indices);
+    }
+}
+
+bool Surface::updateVertices(const std::vector<Vector3f> &vertices, const std::vector<Vector3f> &normals)
+{
+    if (vertices.size() != this->vertices.size() || (!normals.empty() && normals.size() != this->normals.size()))
+    {
+        std::cerr << "Deformed surface " << this->shapeIdx << " should keep its " << this->vertices.size() << " vertices." << std::endl;
+        exit(1);
+    }
+
+    this->vertices = vertices;
+    if (!normals.empty())
+    {
+        this->normals = normals;
+    }
+    this->UpdateAABB();
+
+    // refitting keeps the topology of the first frame, which gets worse as the mesh moves away from it
+    if (this->bvh.refitSahCost > this->bvh.settings.refitThreshold * this->bvh.sahCost)
+    {
+        this->PopulateBVH(this->bvh.settings);
+        return true;
+    }
+    // only a tree that is kept needs its wide nodes and triangle records, a rebuild derives its own
+    this->buildTraversalData();
+    return false;
 }
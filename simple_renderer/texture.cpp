@@ -27,21 +27,49 @@ Texture::Texture(std::string pathToImage)
     }
 }
 
-void Texture::allocate(TextureType type, Vector2i resolution)
+void Texture::allocate(TextureType type, Vector2i resolution, int tileSize)
 {
     this->resolution = resolution;
     this->type = type;
+    this->tileSize = tileSize;
+
+    // tiles on the right and bottom edge are stored whole
+    size_t pixels = size_t(this->resolution.x) * this->resolution.y;
+    if (tileSize > 0)
+        pixels = size_t((resolution.x + tileSize - 1) / tileSize) * ((resolution.y + tileSize - 1) / tileSize) * tileSize * tileSize;
 
     if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA) {
-        uint32_t* dpointer = (uint32_t*) malloc(this->resolution.x * this->resolution.y * sizeof(uint32_t));
+        uint32_t* dpointer = (uint32_t*) malloc(pixels * sizeof(uint32_t));
         this->data = (uint64_t)dpointer;
     }
     else if (this->type == TextureType::FLOAT_ALPHA) {
-        float* dpointer = (float*)malloc(this->resolution.x * this->resolution.y * 4 * sizeof(float));
+        float* dpointer = (float*)malloc(pixels * 4 * sizeof(float));
         this->data = (uint64_t)dpointer;
     }
 }
 
+void Texture::untile()
+{
+    if (this->tileSize == 0)
+        return;
+
+    size_t pixelSize = this->type == TextureType::FLOAT_ALPHA ? 4 * sizeof(float) : sizeof(uint32_t);
+    const char* tiled = (const char*)this->data;
+    char* rows = (char*)malloc(size_t(this->resolution.x) * this->resolution.y * pixelSize);
+
+    // a tile row is contiguous in both layouts
+    for (int y = 0; y < this->resolution.y; y++) {
+        for (int x = 0; x < this->resolution.x; x += this->tileSize) {
+            int width = std::min(this->tileSize, this->resolution.x - x);
+            memcpy(rows + (size_t(y) * this->resolution.x + x) * pixelSize, tiled + this->pixelIndex(x, y) * pixelSize, width * pixelSize);
+        }
+    }
+
+    free((void*)this->data);
+    this->data = (uint64_t)rows;
+    this->tileSize = 0;
+}
+
 void Texture::writePixelColor(Vector3f color, int x, int y)
 {
     if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA) {
@@ -54,7 +82,7 @@ void Texture::writePixelColor(Vector3f color, int x, int y)
 
         uint32_t final = r | g | b | a;
 
-        dpointer[y * this->resolution.x + x] = final;
+        dpointer[this->pixelIndex(x, y)] = final;
     }
 }
 
@@ -135,6 +163,8 @@ void Texture::loadExr(std::string pathToExr)
 
 void Texture::save(std::string path)
 {
+    this->untile();
+
     size_t pos = path.find(".png");
 
     if (pos > path.length()) {
@@ -0,0 +1,41 @@
+#include "triangles.h"
+
+void TriangleRecords::build(const std::vector<Vector3f> &vertices, const std::vector<Vector3f> &vertexNormals, const std::vector<Vector3i> &indices)
+{
+    size_t count = indices.size();
+    for (int a = 0; a < 3; ++a)
+    {
+        this->v0[a].assign(count + TRIANGLE_PADDING, 0.f);
+        this->e1[a].assign(count + TRIANGLE_PADDING, 0.f);
+        this->e2[a].assign(count + TRIANGLE_PADDING, 0.f);
+    }
+    this->normals.resize(count);
+
+    Vector3f lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30);
+    for (const Vector3f &vertex : vertices)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::min(lo[a], vertex[a]);
+            hi[a] = std::max(hi[a], vertex[a]);
+        }
+    }
+    this->origin = vertices.empty() ? Vector3f(0, 0, 0) : 0.5 * (lo + hi);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Vector3i &face = indices[i];
+        for (int a = 0; a < 3; ++a)
+        {
+            this->v0[a][i] = vertices[face.x][a] - this->origin[a];
+            this->e1[a][i] = vertices[face.y][a] - vertices[face.x][a];
+            this->e2[a][i] = vertices[face.z][a] - vertices[face.x][a];
+        }
+        this->normals[i] = Normalize(vertexNormals[face.x] + vertexNormals[face.y] + vertexNormals[face.z]);
+    }
+}
+
+size_t TriangleRecords::bytes() const
+{
+    return 9 * this->v0[0].capacity() * sizeof(float) + this->normals.capacity() * sizeof(Vector3f);
+}
@@ -0,0 +1,224 @@
+#include "surface.h"
+
+static float nodeArea(const BVHNode &node)
+{
+    float dx = node.aabb[1][0] - node.aabb[0][0];
+    float dy = node.aabb[1][1] - node.aabb[0][1];
+    float dz = node.aabb[1][2] - node.aabb[0][2];
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+// Children of the wide node that replaces a binary node, as binary node indices
+template <int N>
+static int wideNodeChildren(const std::vector<BVHNode> &binary, uint32_t binaryNode, uint32_t children[N])
+{
+    int numChildren = 0;
+    if (binary[binaryNode].isLeaf())
+    {
+        children[numChildren++] = binaryNode;
+    }
+    else
+    {
+        children[numChildren++] = binaryNode + 1;
+        children[numChildren++] = binary[binaryNode].offset;
+    }
+
+    // open the interior child with the largest surface area until the node is full
+    while (numChildren < N)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int k = 0; k < numChildren; ++k)
+        {
+            if (!binary[children[k]].isLeaf() && nodeArea(binary[children[k]]) > bestArea)
+            {
+                best = k;
+                bestArea = nodeArea(binary[children[k]]);
+            }
+        }
+        if (best == -1)
+        {
+            break;
+        }
+
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[numChildren++] = binary[opened].offset;
+    }
+    return numChildren;
+}
+
+template <int N>
+static uint32_t collapseNode(const std::vector<BVHNode> &binary, uint32_t binaryNode, std::vector<WideBVHNode<N>> &wide)
+{
+    uint32_t children[N];
+    int numChildren = wideNodeChildren<N>(binary, binaryNode, children);
+
+    uint32_t nodeIdx = wide.size();
+    wide.emplace_back();
+    for (int k = 0; k < N; ++k)
+    {
+        // empty slots get an inverted box that no ray can enter
+        for (int a = 0; a < 3; ++a)
+        {
+            wide[nodeIdx].bmin[a][k] = INFINITY;
+            wide[nodeIdx].bmax[a][k] = -INFINITY;
+        }
+        wide[nodeIdx].child[k] = 0;
+        wide[nodeIdx].Num_Of_Triangles[k] = 0;
+    }
+
+    for (int k = 0; k < numChildren; ++k)
+    {
+        const BVHNode &child = binary[children[k]];
+        for (int a = 0; a < 3; ++a)
+        {
+            wide[nodeIdx].bmin[a][k] = child.aabb[0][a];
+            wide[nodeIdx].bmax[a][k] = child.aabb[1][a];
+        }
+        if (child.isLeaf())
+        {
+            wide[nodeIdx].child[k] = child.offset;
+            wide[nodeIdx].Num_Of_Triangles[k] = child.Num_Of_Triangles;
+        }
+    }
+
+    // interior children are appended after this node; index rather than
+    // reference the node since the vector may grow
+    for (int k = 0; k < numChildren; ++k)
+    {
+        if (!binary[children[k]].isLeaf())
+        {
+            uint32_t childIdx = collapseNode(binary, children[k], wide);
+            wide[nodeIdx].child[k] = childIdx;
+        }
+    }
+
+    return nodeIdx;
+}
+
+template <int N>
+void collapseBVH(const std::vector<BVHNode> &binary, std::vector<WideBVHNode<N>> &wide)
+{
+    wide.clear();
+    if (binary.empty())
+    {
+        return;
+    }
+    wide.reserve(binary.size() / (N - 1) + 1);
+    collapseNode(binary, 0, wide);
+    wide.shrink_to_fit();
+}
+
+template void collapseBVH<4>(const std::vector<BVHNode> &binary, std::vector<WideBVHNode<4>> &wide);
+template void collapseBVH<8>(const std::vector<BVHNode> &binary, std::vector<WideBVHNode<8>> &wide);
+
+template <int N>
+static void quantizeNode(QuantizedBVHNode<N> &node, const BVHNode &box, const std::vector<BVHNode> &binary, const uint32_t children[N], int numChildren)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        // the smallest step for which 255 steps cover the node box
+        float lo = box.aabb[0][a], hi = box.aabb[1][a];
+        int exponent = hi > lo ? std::max(-126, int(std::ceil(std::log2((double(hi) - lo) / 255.0)))) : -126;
+        while (dequantize(lo, 255, quantizationStep(exponent)) < hi)
+        {
+            exponent++;
+        }
+        float step = quantizationStep(exponent);
+        node.origin[a] = lo;
+        node.exponent[a] = int8_t(exponent);
+
+        // round outwards, then correct for the rounding of the decoding
+        for (int k = 0; k < N; ++k)
+        {
+            node.qmin[a][k] = 255;
+            node.qmax[a][k] = 0;
+            if (k >= numChildren)
+            {
+                continue;
+            }
+            const BVHNode &child = binary[children[k]];
+            int qmin = std::min(255, std::max(0, int(std::floor((double(child.aabb[0][a]) - lo) / step))));
+            int qmax = std::min(255, std::max(0, int(std::ceil((double(child.aabb[1][a]) - lo) / step))));
+            while (qmin > 0 && dequantize(lo, qmin, step) > child.aabb[0][a])
+            {
+                qmin--;
+            }
+            while (qmax < 255 && dequantize(lo, qmax, step) < child.aabb[1][a])
+            {
+                qmax++;
+            }
+            node.qmin[a][k] = uint8_t(qmin);
+            node.qmax[a][k] = uint8_t(qmax);
+        }
+    }
+}
+
+template <int N>
+void quantizeBVH(std::vector<BVHNode> &binary, std::vector<Vector3i> &indices, std::vector<QuantizedBVHNode<N>> &quantized)
+{
+    quantized.clear();
+    if (binary.empty())
+    {
+        return;
+    }
+
+    // breadth first, so the interior children of a node can be allocated together
+    std::vector<Vector3i> reordered;
+    reordered.reserve(indices.size());
+    std::vector<std::pair<uint32_t, uint32_t>> queue; // binary node, quantized node
+    queue.emplace_back(0, 0);
+    quantized.emplace_back();
+    for (size_t head = 0; head < queue.size(); ++head)
+    {
+        uint32_t binaryNode = queue[head].first, nodeIdx = queue[head].second;
+        uint32_t children[N];
+        int numChildren = wideNodeChildren<N>(binary, binaryNode, children);
+
+        QuantizedBVHNode<N> node;
+        quantizeNode(node, binary[binaryNode], binary, children, numChildren);
+        node.interior = 0;
+        node.childBase = quantized.size();
+        node.faceBase = reordered.size();
+        uint32_t nextChild = node.childBase;
+        for (int k = 0; k < N; ++k)
+        {
+            node.Num_Of_Triangles[k] = 0;
+            if (k >= numChildren)
+            {
+                continue;
+            }
+            BVHNode &child = binary[children[k]];
+            if (child.isLeaf())
+            {
+                // the faces of the leaf children follow each other
+                node.Num_Of_Triangles[k] = uint8_t(child.Num_Of_Triangles);
+                uint32_t offset = reordered.size();
+                reordered.insert(reordered.end(), indices.begin() + child.offset, indices.begin() + child.offset + child.Num_Of_Triangles);
+                child.offset = offset;
+            }
+            else
+            {
+                node.interior |= 1 << k;
+                queue.emplace_back(children[k], nextChild++);
+            }
+        }
+        quantized.resize(nextChild);
+        quantized[nodeIdx] = node;
+    }
+    indices.swap(reordered);
+}
+
+template void quantizeBVH<4>(std::vector<BVHNode> &binary, std::vector<Vector3i> &indices, std::vector<QuantizedBVHNode<4>> &quantized);
+template void quantizeBVH<8>(std::vector<BVHNode> &binary, std::vector<Vector3i> &indices, std::vector<QuantizedBVHNode<8>> &quantized);
+
+WideBVHRay::WideBVHRay(const Ray &ray)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        this->org[a] = ray.o[a];
+        this->invDir[a] = ray.invDir[a];
+        this->pad[a] = floatUlp(this->org[a]) * std::abs(this->invDir[a]);
+    }
+}